@@ -0,0 +1,42 @@
+#!/bin/bash
+
+# Encodes the same matrices with options that should not change the result,
+# and reports the inputs for which the statistics differ. The second run of each
+# pair also verifies the code lengths and the lazy selection (-vc).
+# Exits with status 1 if any of the runs differ.
+
+ril=${RIL:-../build/ril}
+status=0
+
+function compare {
+    local name=$1 first=$2 second=$3
+    shift 3
+    local a=$($ril $first -e "$@" 2> /dev/null | tail -n1 | cut -f1-7)
+    local b=$($ril $second -vc -e "$@" 2> errors.txt | tail -n1 | cut -f1-7)
+    local mismatches=$(grep -c "does not match" errors.txt)
+    if [ "$a" == "$b" ] && [ "$mismatches" == "0" ]; then
+        echo -e "same\t$name\t$*"
+    else
+        echo -e "DIFFERS\t$name\t$*\t($a) vs ($b), $mismatches failed checks"
+        status=1
+    fi
+}
+
+inputs=(
+    "-rw=128 -rh=128 -ra=4 -rn=0"
+    "-rw=128 -rh=128 -ra=4"
+    "-rw=200 -rh=150 -ra=2 -rs=5:20 -ru=5:20"
+    "-rw=256 -rh=256 -ra=16 -rs=10:30 -rr=.3"
+    "-rw=256 -rh=256 -rs=10:50 -ru=10:20 -rr=.1 -vt"
+)
+
+for input in "${inputs[@]}"
+do
+    compare "lazy/sorted" "-vl=0" "-vl=1" $input
+    compare "lazy/sorted b1" "-vl=0 -vb1" "-vl=1 -vb1" $input
+    compare "rebuild/incremental" "-vi=0" "-vi=1" $input
+    compare "threads 1/4" "-vj=1" "-vj=4" $input
+done
+
+rm -f errors.txt
+exit $status
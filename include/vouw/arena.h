@@ -0,0 +1,79 @@
+/*
+ * VOUW - Spatial, compression-based pattern mining on matrices
+ *
+ * Micky Faas <micky@edukitty.org>
+ * (C) 2017, 2018, 2019, Leiden Institute for Advanced Computer Science
+ */
+
+#pragma once
+#include "vouw.h"
+#include <vector>
+#include <memory>
+#include <cstddef>
+
+VOUW_NAMESPACE_BEGIN
+
+/** Bump allocator that hands out memory from large slabs. Memory is never returned to the
+ *  arena individually, it is freed all at once when the arena is destroyed or cleared. */
+class Arena {
+    public:
+        Arena( std::size_t slabSize =1 << 16 );
+        ~Arena();
+
+        void* allocate( std::size_t bytes, std::size_t align );
+
+        /** Total number of bytes handed out */
+        std::size_t size() const { return m_size; }
+        /** Total number of bytes in the slabs */
+        std::size_t capacity() const { return m_capacity; }
+
+        void clear();
+
+    private:
+        Arena( const Arena& ) =delete;
+        Arena& operator=( const Arena& ) =delete;
+        char* addSlab( std::size_t bytes );
+
+        std::vector<char*> m_slabs;
+        char* m_ptr;
+        std::size_t m_left;
+        std::size_t m_slabSize, m_size, m_capacity;
+};
+
+/** STL allocator that takes its memory from an Arena, or from the heap if it has none.
+ *  A copy of a container does not inherit the arena, such that temporary copies do not
+ *  consume arena memory. */
+template<typename T>
+class ArenaAllocator {
+    public:
+        typedef T value_type;
+        typedef std::false_type propagate_on_container_copy_assignment;
+        typedef std::false_type propagate_on_container_move_assignment;
+        typedef std::true_type propagate_on_container_swap;
+
+        ArenaAllocator( Arena* arena =nullptr ) noexcept : m_arena( arena ) {}
+        template<typename U>
+        ArenaAllocator( const ArenaAllocator<U>& a ) noexcept : m_arena( a.arena() ) {}
+
+        T* allocate( std::size_t n ) {
+            if( m_arena ) return static_cast<T*>( m_arena->allocate( n * sizeof(T), alignof(T) ) );
+            return std::allocator<T>().allocate( n );
+        }
+        void deallocate( T* p, std::size_t n ) {
+            if( !m_arena ) std::allocator<T>().deallocate( p, n );
+        }
+
+        ArenaAllocator select_on_container_copy_construction() const { return ArenaAllocator(); }
+
+        Arena* arena() const { return m_arena; }
+
+    private:
+        Arena* m_arena;
+};
+
+template<typename T, typename U>
+inline bool operator==( const ArenaAllocator<T>& a, const ArenaAllocator<U>& b ) { return a.arena() == b.arena(); }
+template<typename T, typename U>
+inline bool operator!=( const ArenaAllocator<T>& a, const ArenaAllocator<U>& b ) { return a.arena() != b.arena(); }
+
+VOUW_NAMESPACE_END
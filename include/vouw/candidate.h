@@ -8,7 +8,7 @@
 #pragma once
 #include "vouw.h"
 #include "pattern.h"
-#include <unordered_map>
+#include "equivalence.h"
 #include <vector>
 #include <algorithm>
 
@@ -30,28 +30,24 @@ inline bool operator==( const Candidate& c1, const Candidate& c2 ) {
 }
 
 
-// https://stackoverflow.com/a/34006336
-#define HASH_SEED 1009
-#define HASH_FACTOR 9176
-
-struct CandidateHash {
-    std::size_t operator()( const Candidate& c ) const {
-        std::size_t hash = HASH_SEED;
-        hash = hash * HASH_FACTOR + std::hash<int>()(c.offset.position());
-        hash = hash * HASH_FACTOR + std::hash<Pattern*>()(c.p1);
-        hash = hash * HASH_FACTOR + std::hash<Pattern*>()(c.p2);
-        //hash = hash * HASH_FACTOR + std::hash<int>()(c.v1->hash());
-        //hash = hash * HASH_FACTOR + std::hash<int>()(c.v2->hash());
-        return hash;
-    }
-};
-
-typedef std::unordered_map<Candidate,int,CandidateHash> CandidateMapT;
 typedef std::pair<Candidate,double> CandidateGainT;
 typedef std::vector<CandidateGainT> CandidateGainVectorT;
 
+/** Strict total order on candidates, used to break ties between equal gains */
+inline bool candidate_lt( const Candidate& c1, const Candidate& c2 ) {
+    if( c1.p1 != c2.p1 ) return c1.p1->label() < c2.p1->label();
+    if( c1.p2 != c2.p2 ) return c1.p2->label() < c2.p2->label();
+    if( c1.offset != c2.offset ) return c1.offset < c2.offset;
+    if( c1.v1->hash() != c2.v1->hash() ) return c1.v1->hash() < c2.v1->hash();
+    return c1.v2->hash() < c2.v2->hash();
+}
+
+/** Orders by descending gain. Ties are broken on the candidate itself,
+ *  such that the order does not depend on how the candidates were collected. */
 inline bool cg_gain_gt( const CandidateGainT& cg1, const CandidateGainT& cg2 ) {
-    return cg1.second > cg2.second;
+    if( cg1.second != cg2.second )
+        return cg1.second > cg2.second;
+    return candidate_lt( cg1.first, cg2.first );
 }
 
 inline bool cg_pattern_size_lt( const CandidateGainT& cg1, const CandidateGainT& cg2 ) {
@@ -0,0 +1,123 @@
+/*
+ * VOUW - Spatial, compression-based pattern mining on matrices
+ *
+ * Micky Faas <micky@edukitty.org>
+ * (C) 2017, 2018, 2019, Leiden Institute for Advanced Computer Science
+ */
+
+#pragma once
+#include "vouw.h"
+#include "candidate.h"
+#include <vector>
+#include <cstdint>
+
+VOUW_NAMESPACE_BEGIN
+
+/** Compact representation of a Candidate. Patterns are identified by their label
+ *  and variants by an id that is local to the CandidateTable.
+ *  The offset between the pivots of a candidate never has a negative row. */
+struct CandidateKey {
+    uint32_t label1, label2;
+    int32_t col;
+    uint16_t row;
+    uint8_t variant1, variant2;
+};
+
+static_assert( sizeof( CandidateKey ) == 16, "CandidateKey should be packed in 16 bytes" );
+
+inline bool operator==( const CandidateKey& k1, const CandidateKey& k2 ) {
+    return k1.label1 == k2.label1 && k1.label2 == k2.label2 &&
+           k1.col == k2.col && k1.row == k2.row &&
+           k1.variant1 == k2.variant1 && k1.variant2 == k2.variant2;
+}
+
+inline bool operator!=( const CandidateKey& k1, const CandidateKey& k2 ) {
+    return !(k1 == k2);
+}
+
+/** Counts the occurrences of candidates. Open addressing with linear probing and Robin Hood
+ *  insertion: an entry takes the place of one that is closer to its home slot.
+ *  The table keeps the patterns and variants of the counted candidates, such that
+ *  a Candidate can be reconstructed from its key.
+ *  Entries move on insertion and removal, their addresses are not stable. */
+class CandidateTable {
+    public:
+        struct EntryT {
+            CandidateKey key;
+            int count;
+            uint32_t probe; // Distance to the home slot plus one, zero if the slot is empty
+        };
+
+        class const_iterator {
+            public:
+                const_iterator( const EntryT* e, const EntryT* end ) : m_e( e ), m_end( end ) { skip(); }
+                const EntryT& operator*() const { return *m_e; }
+                const EntryT* operator->() const { return m_e; }
+                const_iterator& operator++() { m_e++; skip(); return *this; }
+                bool operator==( const const_iterator& it ) const { return m_e == it.m_e; }
+                bool operator!=( const const_iterator& it ) const { return m_e != it.m_e; }
+            private:
+                void skip() { while( m_e != m_end && !m_e->probe ) m_e++; }
+                const EntryT *m_e, *m_end;
+        };
+
+        CandidateTable();
+
+        /** Returns the key of @c, the patterns and variants of @c are registered with this table */
+        CandidateKey key( const Candidate& c );
+        /** Reconstructs the candidate of @k, which should have been obtained through key() */
+        Candidate candidate( const CandidateKey& k ) const;
+
+        /** Adds @n to the count of @k, inserting it if necessary */
+        void add( const CandidateKey& k, int n =1 );
+        void increment( const Candidate& c ) { add( key( c ), 1 ); }
+        /** Subtracts @n from the count of @k and removes it when it reaches zero */
+        void subtract( const CandidateKey& k, int n =1 );
+        /** Returns the count of @k, or zero if it is not in the table */
+        int count( const CandidateKey& k ) const;
+
+        std::size_t size() const { return m_size; }
+        bool empty() const { return m_size == 0; }
+
+        /** Direct access to the slots, e.g. to divide the table over multiple threads */
+        std::size_t capacity() const { return m_slots.size(); }
+        const EntryT& slot( std::size_t i ) const { return m_slots[i]; }
+        bool isOccupied( std::size_t i ) const { return m_slots[i].probe != 0; }
+
+        const_iterator begin() const { return const_iterator( m_slots.data(), m_slots.data() + m_slots.size() ); }
+        const_iterator end() const { return const_iterator( m_slots.data() + m_slots.size(), m_slots.data() + m_slots.size() ); }
+
+        /** Removes all entries and sizes the table to hold @expected entries.
+         *  The registered patterns and variants are kept, such that keys remain valid. */
+        void reset( std::size_t expected );
+        /** Makes sure @n entries can be inserted without growing the table */
+        void reserve( std::size_t n );
+        /** Removes all entries and registered patterns and variants */
+        void clear();
+
+    private:
+        uint8_t variantId( Variant* v );
+        void rehash( std::size_t capacity );
+        std::size_t find( const CandidateKey& k ) const;
+
+        static std::size_t hash( const CandidateKey& k ) {
+            uint64_t a =((uint64_t)k.label1 << 32) | k.label2;
+            uint64_t b =((uint64_t)(uint32_t)k.col << 32) | ((uint64_t)k.row << 16) | ((uint64_t)k.variant1 << 8) | k.variant2;
+            uint64_t h =(a ^ (b * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL;
+            h ^= h >> 33;
+            h *= 0xc4ceb9fe1a85ec53ULL;
+            h ^= h >> 33;
+            return h;
+        }
+
+        std::vector<EntryT> m_slots;
+        std::size_t m_size;
+        std::size_t m_mask;
+
+        std::vector<Pattern*> m_patterns; // By label
+        std::vector<Variant*> m_variants; // By id, one representative per Variant::hash()
+        std::vector<int> m_variantHashes;
+        std::vector<std::pair<const Variant*,uint8_t>> m_variantAliases;
+};
+
+VOUW_NAMESPACE_END
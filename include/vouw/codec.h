@@ -0,0 +1,119 @@
+/*
+ * VOUW - Spatial, compression-based pattern mining on matrices
+ *
+ * Micky Faas <micky@edukitty.org>
+ * (C) 2017, 2018, 2019, Leiden Institute for Advanced Computer Science
+ */
+
+#pragma once
+#include "vouw.h"
+#include "matrix.h"
+#include "rans.h"
+#include <vector>
+#include <istream>
+#include <ostream>
+#include <memory>
+
+VOUW_NAMESPACE_BEGIN
+
+class Encoder;
+
+/* Layout of the container, all integers are little endian:
+ *   "VOUW", uint16 version, uint16 reserved (0),
+ *   uint32 width, uint32 height, uint32 base, uint64 length of the payload in bytes
+ * The payload is a single rANS stream that holds, in this order:
+ *   the alphabet of the values in the code table, the background value,
+ *   the code table with the shape and values of each pattern, the corrections of the error map
+ *   and the codes of the instances. The instances are coded in the row-major order of their first element,
+ *   such that their position follows from the elements that have been decoded before.
+ *   The codes are adaptive with the same pseudo count as Pattern::codeLength(), their total length equals L(D|CT). */
+#define VOUW_CONTAINER_VERSION 1
+#define VOUW_CONTAINER_HEADER_SIZE 28
+/** Largest number of elements of a matrix that is read from a container, larger dimensions are taken as corrupt */
+#define VOUW_CONTAINER_MAX_ELEMENTS (1ULL << 28)
+
+/** Adaptive code over @n symbols, in which the probability of a symbol is proportional to the number of times
+ *  it has been coded plus the pseudo count, as in Pattern::codeLength(). The weights are kept in a Fenwick tree */
+class AdaptiveCode {
+    public:
+        AdaptiveCode( int n =0 );
+
+        void put( RansEncoder& enc, int s );
+        int get( RansDecoder& dec );
+
+    private:
+        uint64_t prefix( int s ) const;
+        void increment( int s );
+
+        std::vector<uint32_t> m_tree; // One-based
+        uint64_t m_total;
+        int m_highBit;
+};
+
+/** Writes the encoding of an Encoder to a VOUW container */
+class CodecWriter {
+    public:
+        CodecWriter() : m_bytes( 0 ), m_modelBits( 0.0 ), m_dataBits( 0.0 ) {}
+
+        /** Writes the instances and code table of @e to @os. Returns false if the encoding cannot be
+         *  written: instances with a variant, elements that are covered twice or not at all without a
+         *  background value, or a stream error */
+        bool write( const Encoder& e, std::ostream& os );
+
+        /** Size of the last container, including the header */
+        std::size_t bytes() const { return m_bytes; }
+        /** The information content of the code table and the error map, and of the instances */
+        double modelBits() const { return m_modelBits; }
+        double dataBits() const { return m_dataBits; }
+
+    private:
+        std::size_t m_bytes;
+        double m_modelBits, m_dataBits;
+};
+
+/** Reads a VOUW container. The payload is read from the stream as it is decoded,
+ *  and the rows of the matrix are available as soon as all elements in them have been decoded. */
+class CodecReader {
+    public:
+        /** Reads the header from @is, which should stay valid while the reader is used */
+        CodecReader( std::istream& is );
+
+        /** False if the header was not understood or the payload is corrupt */
+        bool isValid() const { return m_valid; }
+
+        unsigned int width() const { return m_width; }
+        unsigned int height() const { return m_height; }
+        unsigned int base() const { return m_base; }
+
+        /** Decodes up to and including the next row, which is copied to @dst of width() elements.
+         *  Returns false if all rows have been read or the input is invalid */
+        bool readRow( Matrix2D::ElementT* dst );
+        /** Decodes the remaining rows into a new matrix, which is owned by the caller. Returns nullptr on error */
+        Matrix2D* readMatrix();
+
+    private:
+        /** A pattern as the offsets of its elements to the first, in row-major order */
+        struct PatternT {
+            std::vector<int> rows, cols;
+            std::vector<Matrix2D::ElementT> values;
+        };
+        bool readModel();
+        bool decodeUntil( std::size_t pos );
+
+        std::istream& m_is;
+        std::unique_ptr<RansDecoder> m_rans;
+        unsigned int m_width, m_height, m_base;
+        bool m_valid;
+        std::vector<PatternT> m_patterns;
+        bool m_hasBackground;
+        Matrix2D::ElementT m_background;
+        AdaptiveCode m_code; // Of the patterns, followed by the background
+        std::vector<Matrix2D::ElementT> m_values;
+        std::vector<bool> m_covered;
+        std::vector<std::pair<std::size_t,Matrix2D::ElementT>> m_corrections; // By position
+        std::size_t m_nextCorrection;
+        std::size_t m_pos;       // First element that has not been decoded
+        unsigned int m_nextRow;
+};
+
+VOUW_NAMESPACE_END
@@ -0,0 +1,27 @@
+/*
+ * VOUW - Spatial, compression-based pattern mining on matrices
+ *
+ * Micky Faas <micky@edukitty.org>
+ * (C) 2018, Leiden Institute for Advanced Computer Science
+ */
+
+#pragma once
+#include "vouw.h"
+
+VOUW_NAMESPACE_BEGIN
+
+/* Cached code lengths for the MDL cost functions.
+ * The values are served from tables indexed by their integer arguments.
+ * A table is immutable once built. reserveCodeLengths() publishes a larger copy instead of growing it,
+ * which makes all functions safe to call from multiple threads, also by encoders that run concurrently.
+ * Arguments that are out of range are computed directly.
+ * The cached values equal the direct computation bit for bit. */
+
+/** Returns lgamma( n + pseudoCount * m ) / log(2) */
+double log2Gamma( unsigned int n, unsigned int m );
+
+/** Makes sure that log2Gamma( n, m ) is cached when 2n+m < @gammaSize and 
+ *  uintCodeLength() is cached for arguments less than @uintSize */
+void reserveCodeLengths( unsigned int gammaSize, unsigned int uintSize );
+
+VOUW_NAMESPACE_END
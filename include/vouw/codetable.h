@@ -7,7 +7,8 @@
 
 #pragma once
 #include "vouw.h"
-#include <list>
+#include "arena.h"
+#include <vector>
 #include <algorithm>
 #include <functional>
 
@@ -20,17 +21,46 @@ class MassFunction;
 inline bool pattern_is_active( const Pattern* );
 inline bool pattern_is_active_gte( const Pattern*, int minSize );
 
-class CodeTable : public std::list<Pattern*> {
+/** The CodeTable owns all patterns ever created by the encoder, stored contiguously by label.
+ *  The active patterns are kept in a separate dense array of labels. */
+class CodeTable {
     public:
+        typedef std::vector<Pattern*>::iterator iterator;
+        typedef std::vector<Pattern*>::const_iterator const_iterator;
+
         CodeTable( int matWidth =0, int matHeight =0, int matBase =0 );
         CodeTable( const Matrix2D* mat );
         ~CodeTable();
 
+        /** Takes ownership of @p and assigns its label. The storage of @p is moved to the arena of this code table */
+        void add( Pattern* p );
+        /** Activates or deactivates @p, which must be in this code table */
+        void setActive( Pattern* p, bool b );
+
+        /** Iterates over all patterns in the order of their labels */
+        iterator begin() { return m_pool.begin(); }
+        iterator end() { return m_pool.end(); }
+        const_iterator begin() const { return m_pool.begin(); }
+        const_iterator end() const { return m_pool.end(); }
+        std::size_t size() const { return m_pool.size(); }
+        Pattern* pattern( int label ) const { return m_pool[label]; }
+
+        /** The labels of the active patterns. The order is arbitrary, unless sortBySizeDesc() was called
+         *  and no patterns have been (de)activated since */
+        const std::vector<int>& activeLabels() const { return m_active; }
+
         void updateCodeLengths( int totalInstances, const MassFunction& distribution );
+        /** Only recomputes the code lengths of @touched, the patterns of which the usage or activity
+         *  has changed since the last update. Their previous contributions are replaced in the totals. */
+        void updateCodeLengths( int totalInstances, const MassFunction& distribution, const std::vector<Pattern*>& touched );
         void sortBySizeDesc();
+        /** Releases the storage of the inactive patterns that are not part of the composition of any 
+         *  active pattern. The arena is compacted when less than half of it is in use. 
+         *  Returns the number of released patterns. */
+        int reclaim();
 
-        inline int countIfActive() const { return std::count_if( begin(), end(), pattern_is_active ); }
-        inline int countIfActiveNonSingleton() const { return countIfActiveGTE( 2 ); }
+        int countIfActive() const { return m_active.size(); }
+        int countIfActiveNonSingleton() const { return m_activeNonSingleton; }
         int countIfActiveGTE( int minSize ) const;
         double totalLength() const { return m_bits; }
         //double bitsPerOffset() const { return m_stdBitsPerOffset; }
@@ -42,8 +72,24 @@ class CodeTable : public std::list<Pattern*> {
         //void sortByUsageDesc();
         //
     private:
+        struct ContributionT {
+            double entryBits, codeBits;
+            bool active;
+        };
+        double updateContribution( Pattern* p, int totalInstances, int ctSize, const MassFunction& distribution );
+        double totalLength( int totalInstances, int ctSize ) const;
+
         int m_width, m_height, m_base, m_nodeCount;
         double m_bits;
+        std::vector<Pattern*> m_pool;       // All patterns by label
+        Arena* m_arena;                     // Storage of the elements and periphery of the patterns
+        std::vector<int> m_active;          // Labels of the active patterns
+        std::vector<int> m_activeIndex;     // Position of each label in m_active, or -1
+        int m_activeNonSingleton;
+        // The contribution of each pattern by label, and the sums over the contributing patterns
+        std::vector<ContributionT> m_contributions;
+        double m_entryBits, m_codeBits;
+        int m_contributingCount;
         double m_stdBitsPerOffset;
 
 };
@@ -11,26 +11,48 @@
 //#include "pattern.h"
 
 #include <vector>
+#include <unordered_map>
 #include <cinttypes>
 
 VOUW_NAMESPACE_BEGIN
 
 class Pattern;
 
+/** The occupancy bitmap of the bounding box of a pattern, packed in 64-bit words */
 class Configuration {
     public:
-        typedef std::vector<bool> DataT;
+        typedef std::vector<uint64_t> DataT;
         Configuration( const Pattern& p );
 
         bool operator==( const Configuration& rhs ) const;
 
+        /** Hash of the bitmap and its dimensions */
+        uint64_t fingerprint() const { return m_fingerprint; }
+
     private:
         DataT m_data;
-        int m_width;
+        int m_width, m_height;
+        uint64_t m_fingerprint;
         void setFromPattern( const Pattern& p );
 };
 
 typedef std::vector<Configuration> ConfigVectorT;
 typedef ConfigVectorT::size_type ConfigIDT;
 
+/** Assigns consecutive ids to distinct configurations. Configurations are looked up by their 
+ *  fingerprint and only compared in full if the fingerprints are equal. */
+class ConfigurationRegistry {
+    public:
+        /** Returns the id of @c, which is registered if it has not been seen before */
+        ConfigIDT id( const Configuration& c );
+        const Configuration& operator[]( ConfigIDT id ) const { return m_configs[id]; }
+
+        ConfigVectorT::size_type size() const { return m_configs.size(); }
+        void clear();
+
+    private:
+        ConfigVectorT m_configs;
+        std::unordered_multimap<uint64_t,ConfigIDT> m_index;
+};
+
 VOUW_NAMESPACE_END
@@ -12,9 +12,12 @@
 #include "instance_matrix.h"
 #include "massfunction.h"
 #include "candidate.h"
+#include "candidate_table.h"
 #include "configuration.h"
 #include "errormap.h"
 #include <map>
+#include <unordered_map>
+#include <algorithm>
 
 VOUW_NAMESPACE_BEGIN
 
@@ -26,6 +29,8 @@ class Encoder {
     public:
         enum LocalSearch { NoLocalSearch, FloodFill };
         enum Heuristic { Best1, BestN };
+        enum CandidateSearch { FullSearch, IncrementalSearch };
+        enum CandidateSelection { SortedSelection, LazySelection };
 
         Encoder( EquivalenceSet* = new EquivalenceSet() );
         Encoder( Matrix2D* mat, EquivalenceSet* = new EquivalenceSet() );
@@ -35,7 +40,10 @@ class Encoder {
         bool isValid() const;
 
         void setFromMatrix( Matrix2D* mat, bool useTabu =true );
+        /** Encodes @mat with the read-only model @ct, which is not owned by the encoder.
+         *  No patterns are searched for; encodeStep() and reencode() do nothing afterwards */
         void setFromMatrixUsing( Matrix2D* mat, CodeTable* ct );
+        bool isFixedModel() const { return m_isFixedModel; }
 
         EquivalenceSet* equivalenceSet();
         void setEquivalenceSet( EquivalenceSet* ) ;
@@ -46,11 +54,34 @@ class Encoder {
         void setHeuristic( Heuristic c ) { m_heuristic =c; }
         int heuristic() const { return m_heuristic; }
 
+        /** In incremental mode the candidate map is kept up to date after each merge,
+          * instead of being rebuilt from scratch every iteration */
+        void setCandidateSearchMode( CandidateSearch c ) { m_candidateSearch =c; }
+        int candidateSearchMode() const { return m_candidateSearch; }
+
+        /** In lazy mode the candidates are ordered by an upper bound on their gain,
+          * and the exact gain is only computed for those that may be selected */
+        void setCandidateSelectionMode( CandidateSelection c ) { m_candidateSelection =c; }
+        int candidateSelectionMode() const { return m_candidateSelection; }
+
+        /** Number of threads used to count candidates and estimate their gain.
+          * In incremental mode the candidates are counted by a single thread */
+        void setThreadCount( int n ) { m_threadCount =std::max( 1, n ); }
+        int threadCount() const { return m_threadCount; }
+
+        /** Debug only: compare the incrementally updated code lengths to a full recomputation */
+        void setVerifyCodeLengths( bool b ) { m_verifyCodeLengths =b; }
+        bool verifyCodeLengths() const { return m_verifyCodeLengths; }
+        /** Debug only: compare the candidates chosen by the lazy selection to those of the sorted selection */
+        void setVerifySelection( bool b ) { m_verifySelection =b; }
+        bool verifySelection() const { return m_verifySelection; }
+
         void clear();
 
         bool encodeStep();
         int encode();
         void reencode();
+        /** Reconstructs the encoded matrix, which is owned by the caller */
         Matrix2D* decode();
         
         bool isEncoded() const { return m_isEncoded; }
@@ -66,51 +97,150 @@ class Encoder {
         int totalCount() const { return m_instanceCount + m_tabuCount; }
 
         double compressedSize() const { return m_encodedBits; }
+        /** L(D|CT) of a fixed model, i.e. compressedSize() without the size of the code table */
+        double dataSize() const { return m_dataBits; }
+        /** Usage of @p in the encoding, also for a fixed model that does not store it in the patterns */
+        int usage( const Pattern* p ) const { return m_isFixedModel ? m_fixedUsage[p->label()] : p->usage(); }
         double ratio() const { return m_encodedBits / m_priorBits; }       
 
     private:
         Encoder( const Encoder& ) {}
+        /** Bookkeeping of the contribution of a single instance to the candidate map */
+        typedef std::pair<InstanceVector::IndexT,int> OverlapT;
+        struct InstanceCandidatesT {
+            std::vector<CandidateKey> candidates;
+            std::vector<OverlapT> overlaps;
+        };
+
+        /** Candidates counted by a single thread over a band of instances.
+         *  Pairs of instances of the same pattern are only collected, as their overlap
+         *  needs to be resolved in the order of the instances. They are partitioned by
+         *  pattern and overlap coefficient, such that the partitions can be resolved in parallel. */
+        struct SelfPairT {
+            InstanceVector::IndexT i, idx;
+            int overlapCoeff;
+        };
+        struct CandidateShardT {
+            CandidateTable candidates;
+            std::vector<std::vector<SelfPairT>> selfPairs;
+        };
+
+        /** The elements of a pattern as runs of adjacent columns, with their values in the same order */
+        struct DecodeLayoutT {
+            struct RunT {
+                int row, col, length, first;
+            };
+            std::vector<RunT> runs;
+            std::vector<Matrix2D::ElementT> values;
+        };
+        void decodeBand( int rowBegin, int rowEnd, const std::vector<DecodeLayoutT>& layouts, Matrix2D::ElementT* values ) const;
+
         void rebuildCandidateMap();
-        double updateCodeLengths();
+        bool countSingletonCandidates();
+        void countCandidatesParallel();
+        void countCandidateShard( InstanceVector::IndexT begin, InstanceVector::IndexT end, CandidateShardT* shard );
+        void resolveSelfPairs( const std::vector<CandidateShardT>& shards, int part, CandidateTable* candidates );
+        /** State of the lazy-greedy candidate selection. The usage and model size are
+         *  taken at the start of the iteration, so that gains are computed as if evaluated up-front. */
+        struct UsageBucketT {
+            double bound;    // Upper bound on the gain of the candidates with this usage
+            int count;       // Usage of the candidates
+            std::size_t end; // End of the bucket in LazySelectionT::keys
+        };
+        struct LazySelectionT {
+            std::vector<CandidateKey> keys;    // Candidates by bucket
+            std::vector<UsageBucketT> buckets; // In decreasing order of the bound
+            std::size_t next;                  // Next candidate in keys, in bucket @bucket
+            int bucket;
+            CandidateGainVectorT exact;        // Heap of evaluated candidates, ordered by cg_gain_gt
+            double minValuesLength;            // Least Pattern::entryValuesLength() of the active patterns
+            int modelSize, totalCount;
+            bool positiveOnly, popped;
+            int evaluated;
+        };
+        void selectCandidates( const CandidateGainVectorT& sorted, LazySelectionT* lazy, CandidateGainVectorT& chosen );
+        bool checkSelection( const CandidateGainVectorT& chosen, int modelSize );
+        void initLazySelection( LazySelectionT& sel, int modelSize );
+        bool nextLazyCandidate( LazySelectionT& sel, const std::vector<Pattern*>& usedps, const CandidateGainT*& cg );
+        double gainBoundByUsage( int usage, const int* minUsage, const LazySelectionT& sel );
+
+        void computeGainShard( std::size_t begin, std::size_t end, int modelSize, CandidateGainVectorT* gainvec );
+        void computeGainParallel( CandidateGainVectorT& gainvec, int modelSize );
+        void updateCandidateMap();
+        void countCandidates( InstanceVector::IndexT i, InstanceVector::IndexT marker, InstanceCandidatesT* record =nullptr );
+        void instanceChanged( InstanceVector::IndexT i );
+        void invalidateCandidateMap() { m_candidatesValid =false; }
+        double updateCodeLengths( bool full =false );
+        double fixedModelLength();
+        static double singletonLength( const MassFunction& distribution, int width, int height );
         double computeCandidateEntryLength( const Candidate*, bool debugPrint =false );
-        double computeGain( const Candidate*, int usage, int modelSize, bool debugPrint =false );
+        double computeGain( const Candidate*, int usage, int modelSize, int totalCount, bool debugPrint =false );
         double computePruningGain( const Pattern* p );
         double computeDecompositionGain( const Pattern* p, int modelSize, bool debugPrint =false );
         double processCandidate( const CandidateGainT& pair, bool& usedFloodFill, int& modelSize );
-        void mergePatterns( const Candidate*, InstanceIndexVectorT& changelist );
+        bool mergePatterns( const Candidate*, InstanceIndexVectorT& changelist );
         void addPattern( Pattern* );
+        Pattern* findDuplicate( const Pattern* p, Pattern::OffsetT& shift ) const;
         bool floodFill( InstanceIndexVectorT&, int& modelSize );
         bool noisyFloodFill( InstanceIndexVectorT&, int& modelSize );
         bool prunePattern( Pattern*, bool onlyZeroPattern = true );
         void decompose( Instance& );
+        void addPosting( const Pattern* p, InstanceVector::IndexT i );
+        void setPostings( const Pattern* p, const InstanceIndexVectorT& insts, bool merge =false );
+        void trimPostings( const Pattern* p );
         void rebuildInstanceMatrix( bool sort = false );
+        void compactInstances( bool force =false );
 
         EquivalenceSet* m_es;
         Matrix2D* m_mat;
         CodeTable* m_ct;
         InstanceVector m_instvec;
         InstanceMatrix m_instmat;
-        CandidateMapT m_candidates;
-        ConfigVectorT m_configvec;
+        CandidateTable m_candidates;
+        ConfigurationRegistry m_configs;
+        /** The canonical patterns in the code table by Pattern::contentHash() */
+        std::unordered_multimap<uint64_t,Pattern*> m_patternIndex;
         ErrorMapT m_errormap; 
         std::vector<InstanceVector::IndexT> m_instanceMarker;
         std::vector<Instance::BitmaskT> m_overlapMask;
+        std::vector<InstanceCandidatesT> m_instanceCandidates;
+        InstanceIndexVectorT m_changedInstances;
+        /** Indices of the instances of each pattern by label, in increasing order.
+         *  Entries may be stale, i.e. refer to an instance that has been cleared or changed since */
+        std::vector<InstanceIndexVectorT> m_postings;
+        /** Patterns of which the usage or activity has changed since the last code length update */
+        std::vector<Pattern*> m_touchedPatterns;
+        InstanceVector::IndexT m_markerStamp;
+        /** Stamp of the last update of the candidate map in which each instance was marked dirty */
+        std::vector<uint32_t> m_dirtyMarker;
+        uint32_t m_dirtyStamp;
+        bool m_candidatesValid;
 
         typedef std::pair<Pattern*,Variant*> PatternVariantT;
         typedef std::map<Matrix2D::ElementT,PatternVariantT> SingletonEqvMapT;
         typedef std::map<Pattern*,int> PatternUsageMapT;
         SingletonEqvMapT m_smap; // Singleton equivalence mapping
+        /** Fixed model: the usage of each pattern by label, followed by the singletons 
+         *  of the values that the model does not have, which are owned by the encoder */
+        bool m_isFixedModel;
+        std::vector<int> m_fixedUsage;
+        std::vector<Pattern*> m_escapes;
         
         double m_priorBits;
         double m_encodedBits;
+        double m_dataBits;
         bool m_isEncoded;
-        int m_lastLabel;
         int m_decompositions;
         int m_iteration;
         int m_tabuCount;
         int m_instanceCount;
         int m_local;
         int m_heuristic;
+        int m_candidateSearch;
+        int m_candidateSelection;
+        int m_threadCount;
+        bool m_verifyCodeLengths;
+        bool m_verifySelection;
         
 };
 
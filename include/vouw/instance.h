@@ -9,6 +9,7 @@
 #include "vouw.h"
 #include <vector>
 #include <algorithm>
+#include <cstdint>
 #include <vouw/equivalence.h>
 #include "matrix.h"
 
@@ -16,56 +17,17 @@ VOUW_NAMESPACE_BEGIN
 
 class Pattern;
 class Variant;
-class Instance;
-
-inline bool instance_is_null( const Instance& );
-
-class InstanceVector : public std::vector<Instance> {
-    public:
-        typedef uint32_t IndexT;
-        InstanceVector( int matWidth =0, int matHeight =0, int matBase =0 );
-        InstanceVector( const Matrix2D* mat );
-        ~InstanceVector();
-
-        void clearBitmasks();
-        //void unflagAll();
-        inline void eraseIfEmpty( InstanceVector::iterator begin, InstanceVector::iterator end ) { erase( std::remove_if( begin, end, instance_is_null ), end ); }
-
-        void updateCodeLengths( int modelSize );
-
-        inline double totalCodeLength() const { return m_bits; }
-        inline double bitsPerPivot() const { return m_stdBitsPerPivot; }
-        static double bitsPerPivot( std::size_t pivotCount );
-//        double bitsPerVariant() const { return m_stdBitsPerVariant; }
-
-        void setMatrixSize( int width, int height, int base );
-        inline int matrixWidth() const { return m_width; }
-        inline int matrixHeight() const { return m_height; }
-
-        void decompose( const Instance& );
-
-        void deleteAll();
-
-    private:
-        void decomposeRecursive( const Instance& );
-        int m_width, m_height, m_base, m_nodeCount;
-        double m_bits;
-        double m_stdBitsPerPivot;
-//        double m_stdBitsPerVariant;
-};
-
-typedef std::vector<InstanceVector::IndexT> InstanceIndexVectorT;
 
 class Instance {
     public:
         typedef std::vector<bool> BitmaskT;
-        Instance( Pattern* pattern, const Coord2D& pivot, const Variant* variant );
-        Instance();
-        ~Instance();
+        Instance( Pattern* pattern, const Coord2D& pivot, const Variant* variant ) 
+            : m_pattern( pattern ), m_pivot( pivot ), m_variant( variant ) {}
+        Instance() : m_pattern( NULL ), m_variant( NULL ) {}
 
         void apply( Matrix2D* );
 
-        inline void setPattern( Pattern* p );
+        inline void setPattern( Pattern* p ) { m_pattern =p; }
         inline Pattern* pattern() const { return m_pattern; }
 
         inline void setPivot( const Coord2D& c ) { m_pivot =c; }
@@ -91,13 +53,102 @@ class Instance {
         Pattern* m_pattern;
         Coord2D m_pivot;
 
-        friend class InstanceVector;
         mutable const Variant* m_variant;
     //    mutable BitmaskT m_bitmask;
         //mutable double m_variantBits;
     //    mutable int m_marker;
 };
 
+/** Stores the instances in separate columns: the label of the pattern, the pivot packed
+ *  in 32 bits and a small id for the variant. The patterns and variants are registered 
+ *  with the vector when an instance is stored, such that the Instance can be reconstructed. 
+ *  The elements are therefore accessed by value; use set() and setEmpty() to modify them. */
+class InstanceVector {
+    public:
+        typedef uint32_t IndexT;
+        static const IndexT nullIndex =UINT32_MAX;
+
+        class const_iterator {
+            public:
+                const_iterator( const InstanceVector* v, IndexT i ) : m_v( v ), m_i( i ) {}
+                Instance operator*() const { return (*m_v)[m_i]; }
+                const_iterator& operator++() { m_i++; return *this; }
+                bool operator==( const const_iterator& it ) const { return m_i == it.m_i; }
+                bool operator!=( const const_iterator& it ) const { return m_i != it.m_i; }
+            private:
+                const InstanceVector* m_v;
+                IndexT m_i;
+        };
+
+        InstanceVector( int matWidth =0, int matHeight =0, int matBase =0 );
+        InstanceVector( const Matrix2D* mat );
+        ~InstanceVector();
+
+        std::size_t size() const { return m_labels.size(); }
+        bool empty() const { return m_labels.empty(); }
+        void reserve( std::size_t n );
+        void clear();
+
+        void push_back( const Instance& );
+        void emplace_back( Pattern* pattern, const Coord2D& pivot, const Variant* variant ) { push_back( Instance( pattern, pivot, variant ) ); }
+        Instance back() const { return (*this)[size()-1]; }
+
+        inline Instance operator[]( IndexT i ) const { return Instance( pattern( i ), pivot( i ), variant( i ) ); }
+        /** Replaces the instance at @i */
+        void set( IndexT i, const Instance& );
+        /** Marks the instance at @i for deletion by eraseIfEmpty() */
+        inline void setEmpty( IndexT i ) { m_labels[i] =nullLabel; }
+
+        /* Column-wise access to a single instance */
+        inline bool isEmpty( IndexT i ) const { return m_labels[i] == nullLabel; }
+        inline Pattern* pattern( IndexT i ) const { return isEmpty( i ) ? NULL : m_patterns[m_labels[i]]; }
+        inline Coord2D pivot( IndexT i ) const { return Coord2D( m_pivots[i] >> 16, m_pivots[i] & 0xffff ); }
+        inline const Variant* variant( IndexT i ) const { return m_variants[m_variantIds[i]]; }
+
+        const_iterator begin() const { return const_iterator( this, 0 ); }
+        const_iterator end() const { return const_iterator( this, size() ); }
+
+        void clearBitmasks();
+        //void unflagAll();
+        /** Removes the empty instances, the order of the other instances is preserved.
+         *  If @remap is given, it receives the new index of each instance or nullIndex if it was removed */
+        void eraseIfEmpty( std::vector<IndexT>* remap =nullptr );
+        /** Sorts the instances by their pivot in linear time (radix sort) */
+        void sortByPivot();
+
+        void updateCodeLengths( int modelSize );
+
+        inline double totalCodeLength() const { return m_bits; }
+        inline double bitsPerPivot() const { return m_stdBitsPerPivot; }
+        static double bitsPerPivot( std::size_t pivotCount );
+//        double bitsPerVariant() const { return m_stdBitsPerVariant; }
+
+        void setMatrixSize( int width, int height, int base );
+        inline int matrixWidth() const { return m_width; }
+        inline int matrixHeight() const { return m_height; }
+
+        void decompose( const Instance& );
+
+        void deleteAll();
+
+    private:
+        static const uint32_t nullLabel =UINT32_MAX;
+        uint8_t variantId( const Variant* v );
+        void decomposeRecursive( const Instance& );
+        int m_width, m_height, m_base, m_nodeCount;
+        double m_bits;
+        double m_stdBitsPerPivot;
+//        double m_stdBitsPerVariant;
+
+        std::vector<uint32_t> m_labels;         // Label of the pattern, or nullLabel if empty
+        std::vector<uint32_t> m_pivots;         // row << 16 | col, which sorts in row-major order
+        std::vector<uint8_t> m_variantIds;
+        std::vector<Pattern*> m_patterns;       // By label
+        std::vector<const Variant*> m_variants; // By id
+};
+
+typedef std::vector<InstanceVector::IndexT> InstanceIndexVectorT;
+
 bool operator<(const Instance&, const Instance& );
 
 inline bool instance_less_than( const Instance* inst1, const Instance* inst2 ) {
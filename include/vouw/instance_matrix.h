@@ -8,49 +8,58 @@
 #pragma once
 #include "vouw.h"
 #include "instance.h"
-#include <unordered_map>
+#include <vector>
 
 VOUW_NAMESPACE_BEGIN
 
+/** Maps each element of the matrix to the index of the instance that covers it.
+ *  The indices are stored in a flat row-major array that is padded with a border of empty elements,
+ *  such that the periphery of any instance can be looked up without checking the bounds.
+ */
 class InstanceMatrix {
     public: 
-        typedef unsigned int KeyT;
+        typedef int KeyT;
         typedef InstanceVector::IndexT IndexT;
-        typedef std::unordered_map<KeyT, IndexT> MapT;
+        typedef std::vector<IndexT> BufferT;
 
         static IndexT empty;
 
         InstanceMatrix();
-        InstanceMatrix( int rowLength );
+        InstanceMatrix( int width, int height );
         ~InstanceMatrix();
 
-        IndexT at( const Coord2D& );
-        IndexT at( int row, int col );
+        IndexT at( const Coord2D& ) const;
+        IndexT at( int row, int col ) const;
+
+        /** Unchecked lookup by key, the key should lie inside the matrix or its border */
+        inline IndexT at( KeyT k ) const { return m_buffer[k]; }
 
-        IndexT operator[]( const Coord2D& );
-        const IndexT operator[]( const Coord2D& ) const;
+        IndexT operator[]( const Coord2D& c ) const { return at( c ); }
 
         void place( IndexT idx, const Instance&, const Coord2D& pivot );
         void place( IndexT idx, const Instance& );
 
         void remove( const Instance& );
 
-        void setRowLength( int rowlength ) { m_rowLength =rowlength; }
-        int rowLength() const { return m_rowLength; }
+        void setSize( int width, int height );
+        int rowLength() const { return m_width; }
+        int height() const { return m_height; }
 
-        void clear();
+        /** Distance between the keys of two vertically adjacent elements */
+        inline int stride() const { return stride( m_width ); }
+        static inline int stride( int rowLength ) { return rowLength + 2; }
 
-        size_t occupancy() const { return m_map.size(); }
-      //  size_t count() const { return m_count; }
+        inline KeyT key( const Coord2D& c ) const { return key( c.row(), c.col() ); }
+        inline KeyT key( int row, int col ) const { return (row+1) * stride() + col + 1; }
 
-    private:
-        inline KeyT key( const Coord2D& ) const;
-        inline KeyT key( int row, int col ) const;
-        MapT m_map;
-        int m_rowLength;
-        //size_t m_count;
+        void clear();
 
+        size_t occupancy() const { return m_count; }
 
+    private:
+        BufferT m_buffer;
+        int m_width, m_height;
+        size_t m_count;
 };
 
 VOUW_NAMESPACE_END
@@ -8,19 +8,38 @@
 #pragma once
 
 #include "matrix.h"
-#include <unordered_map>
+#include <vector>
+#include <utility>
+#include <cstddef>
 
 VOUW_NAMESPACE_BEGIN
 
 /** Models a finite probability mass function on integers that can be dynamically updated.
- *  Under the hood a hashmap is utilized to store the absolute frequencies of the given integers.
+ *  While all values are small, the absolute frequencies are stored in a flat array indexed by value.
+ *  Once a large value is added, they are moved to an open addressing hash table.
  */
 class MassFunction {
     public:
         typedef unsigned int CountT;
         typedef Matrix2D::ElementT ElementT;
-        typedef std::unordered_map<ElementT,CountT> MapT;
-        MassFunction();
+        typedef std::pair<ElementT,CountT> EntryT;
+
+        /** Iterates over the values with a non-zero count, as (value, count) pairs */
+        class const_iterator {
+            public:
+                const_iterator( const MassFunction* f, std::size_t i ) : m_f( f ), m_i( i ) { skip(); }
+                EntryT operator*() const { return m_f->entry( m_i ); }
+                const_iterator& operator++() { m_i++; skip(); return *this; }
+                bool operator==( const const_iterator& it ) const { return m_i == it.m_i; }
+                bool operator!=( const const_iterator& it ) const { return m_i != it.m_i; }
+            private:
+                void skip() { while( m_i != m_f->slotCount() && !m_f->entry( m_i ).second ) m_i++; }
+                const MassFunction* m_f;
+                std::size_t m_i;
+        };
+
+        /** If @range is given, the values in [0,@range) are expected */
+        MassFunction( ElementT range =0 );
 
         CountT count( const ElementT& ) const;
         double p( const ElementT& ) const;
@@ -28,23 +47,50 @@ class MassFunction {
         void setCount( const ElementT&, const CountT& );
         void decrement( const ElementT& );
         void increment( const ElementT& );
+        /** Increments the counts of the @n values in @values, 
+         *  which may be stored as uint8_t, uint16_t or uint32_t */
+        template<typename T> void increment( const T* values, std::size_t n );
         void erase( const ElementT& );
         void clear();
 
-        ElementT lowerBound() const { return m_lower; }
-        ElementT upperBound() const { return m_upper; }
-        ElementT range() const { return m_count ? m_upper - m_lower + 1 : 0; }
+        ElementT lowerBound() const { if( !m_boundsValid ) updateBounds(); return m_lower; }
+        ElementT upperBound() const { if( !m_boundsValid ) updateBounds(); return m_upper; }
+        ElementT range() const { return m_count ? upperBound() - lowerBound() + 1 : 0; }
         CountT totalElements() const { return m_count; }
-        CountT uniqueElements() const { return m_elements.size(); }
+        CountT uniqueElements() const { return m_unique; }
+
+        /** True if the counts are stored in a flat array */
+        bool isDense() const { return m_isDense; }
 
-        MapT& elements() { return m_elements; }
-        const MapT& elements() const { return m_elements; }
+        const_iterator begin() const { return const_iterator( this, 0 ); }
+        const_iterator end() const { return const_iterator( this, slotCount() ); }
 
     private:
-        MapT m_elements;
-        ElementT m_lower;
-        ElementT m_upper;
+        struct SlotT {
+            ElementT value;
+            CountT count;
+        };
+
+        std::size_t slotCount() const { return m_isDense ? m_dense.size() : m_sparse.size(); }
+        EntryT entry( std::size_t i ) const;
+        const CountT* find( ElementT n ) const;
+        CountT& insert( ElementT n );
+        void added( ElementT n );
+        void removed( ElementT n );
+        void makeSparse();
+        void rehash( std::size_t capacity );
+        void updateBounds() const;
+
+        std::vector<CountT> m_dense;  // By value
+        std::vector<SlotT> m_sparse;  // Linear probing, slots are kept when their count drops to zero
+        std::size_t m_sparseSize;     // Number of used slots
+        bool m_isDense;
+        // After the removal of an outer value, the bounds enclose the values but may not be tight
+        mutable ElementT m_lower;
+        mutable ElementT m_upper;
+        mutable bool m_boundsValid;
         CountT m_count;
+        CountT m_unique;
 };
 
 VOUW_NAMESPACE_END
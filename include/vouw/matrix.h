@@ -8,49 +8,69 @@
 #pragma once
 #include "vouw.h"
 #include <cinttypes>
+#include <cassert>
+#include <vector>
 
 VOUW_NAMESPACE_BEGIN
 
-#define VOUW_UNODE32_FLAGGED (1U << 31)
-
+/** Position in a matrix, or the offset between two positions.
+ *  Coordinates are plain values that do not know the dimensions of the matrix; 
+ *  they are ordered row-major, which is the order of their positions in any matrix. */
 class Coord2D {
     public:
-        typedef struct {
-            int row,col;
-        } PairT;
-
-        PairT m;
-
-        Coord2D( int row, int col, int rowLength =0 ) : m( {row,col} ), m_rowLength(rowLength) {}
-        Coord2D() : m( {0,0} ) {}
-
-        void setRow( int row) { m.row =row; }
-        int row() const { return m.row; }
+        Coord2D( int row, int col ) : m_row( row ), m_col( col ) {}
+        Coord2D() : m_row( 0 ), m_col( 0 ) {}
 
-        void setCol( int col) { m.col =col; }
-        int col() const { return m.col; }
+        void setRow( int row) { m_row =row; }
+        int row() const { return m_row; }
 
-        bool isZero() { return m.row == 0 && m.col == 0; }
+        void setCol( int col) { m_col =col; }
+        int col() const { return m_col; }
 
-        void setRowLength( int rowLength ) { m_rowLength = rowLength; } 
-        int rowLength() const { return m_rowLength; }
+        bool isZero() const { return m_row == 0 && m_col == 0; }
 
-        virtual int position() const;
+        /** Returns the linear position in a matrix with rows of @rowLength elements */
+        int position( int rowLength ) const { return rowLength*m_row + m_col; }
 
     private:
-        int m_rowLength;
-
+        int32_t m_row, m_col;
 };
 
-bool operator==( const Coord2D&, const Coord2D& );
-bool operator!=( const Coord2D&, const Coord2D& );
-bool operator<=( const Coord2D&, const Coord2D& );
-bool operator<( const Coord2D&, const Coord2D& );
-bool operator>=( const Coord2D&, const Coord2D& );
-bool operator>( const Coord2D&, const Coord2D& );
+static_assert( sizeof( Coord2D ) == 8, "Coord2D should be packed in 8 bytes" );
+
+/** Row-major order */
+inline bool coord_lt( const Coord2D& c1, const Coord2D& c2 ) {
+    return c1.row() < c2.row() || (c1.row() == c2.row() && c1.col() < c2.col());
+}
+
+inline bool operator==( const Coord2D& c1, const Coord2D& c2 ) { return c1.row() == c2.row() && c1.col() == c2.col(); }
+inline bool operator!=( const Coord2D& c1, const Coord2D& c2 ) { return !(c1 == c2); }
+inline bool operator<( const Coord2D& c1, const Coord2D& c2 ) { return coord_lt( c1, c2 ); }
+inline bool operator>( const Coord2D& c1, const Coord2D& c2 ) { return coord_lt( c2, c1 ); }
+inline bool operator<=( const Coord2D& c1, const Coord2D& c2 ) { return !coord_lt( c2, c1 ); }
+inline bool operator>=( const Coord2D& c1, const Coord2D& c2 ) { return !coord_lt( c1, c2 ); }
+
+/** Returns the 64 bits of the bit-plane @plane that start at bit @i, bits past its end read as zero */
+inline uint64_t bitPlaneWindow( const std::vector<uint64_t>& plane, std::size_t i ) {
+    const std::size_t w =i >> 6, s =i & 63;
+    uint64_t window =w < plane.size() ? plane[w] >> s : 0;
+    if( s && w+1 < plane.size() ) window |= plane[w+1] << (64 - s);
+    return window;
+}
+
+/** Sets the bits of @bits in the bit-plane @plane, starting at bit @i. Bits past its end are ignored */
+inline void bitPlaneSet( std::vector<uint64_t>& plane, std::size_t i, uint64_t bits ) {
+    const std::size_t w =i >> 6, s =i & 63;
+    if( w < plane.size() ) plane[w] |= bits << s;
+    if( s && w+1 < plane.size() ) plane[w+1] |= bits >> (64 - s);
+}
 
 class MassFunction;
 
+/** Matrix of non-negative integers. The elements are stored in the narrowest of 1, 8, 16 or 32 bits
+ *  that holds all values: initially the width that fits @base, the storage is widened 
+ *  as soon as a larger value is set. Values are always passed as ElementT.
+ *  Binary matrices are bit-packed, each row starts at a new 64-bit word. */
 class Matrix2D {
     public:
         typedef uint32_t ElementT;
@@ -67,28 +87,73 @@ class Matrix2D {
 
         void clear();
 
-        ElementT* data();
-        const ElementT* data() const;
-        ElementT* rowPtr( unsigned int row );
-        const ElementT* rowPtr( unsigned int row ) const;
-
-        //ElementT& value( Coord2D );
-        ElementT value( Coord2D ) const;
+        /** Number of bits per element, either 1, 8, 16 or 32 */
+        int elementBits() const { return m_elementBits; }
+        bool isBitPacked() const { return m_elementBits == 1; }
+        /** Direct access to the storage, T should be the unsigned integer of elementBits() bits */
+        template<typename T> const T* buffer() const { 
+            assert( sizeof( T ) * 8 == m_elementBits );
+            return reinterpret_cast<const T*>( m_buffer.data() ); 
+        }
+        /** Number of words per row of a bit-packed matrix */
+        int rowWords() const { return m_rowWords; }
+        /** The words of @row of a bit-packed matrix, bit j of word w holds column 64w+j */
+        const uint64_t* rowBits( unsigned int row ) const { 
+            assert( isBitPacked() );
+            return reinterpret_cast<const uint64_t*>( m_buffer.data() ) + (std::size_t)row * m_rowWords;
+        }
+        /** Returns the 64 elements of a bit-packed matrix starting at @col in @row, 
+         *  columns outside the matrix read as zero */
+        uint64_t bitWindow( int row, int col ) const {
+            const uint64_t* bits =rowBits( row );
+            const int w =col >> 6, s =col & 63;
+            uint64_t window =0;
+            if( w >= 0 && w < m_rowWords ) window =bits[w] >> s;
+            if( s && w+1 >= 0 && w+1 < m_rowWords ) window |= bits[w+1] << (64 - s);
+            return window;
+        }
+        /** Copies the values of @row to @dst, which holds width() elements */
+        void readRow( unsigned int row, ElementT* dst ) const;
+        /** Sets the values of @row from @src, which holds width() elements */
+        void writeRow( unsigned int row, const ElementT* src );
+
+        ElementT value( Coord2D c ) const { 
+            switch( m_elementBits ) {
+                case 1: return (rowBits( c.row() )[c.col() >> 6] >> (c.col() & 63)) & 1;
+                case 8: return m_buffer[c.col() + c.row() * width()];
+                case 16: return buffer<uint16_t>()[c.col() + c.row() * width()];
+                default: return buffer<uint32_t>()[c.col() + c.row() * width()];
+            }
+        }
         void setValue( Coord2D, const ElementT&);
 
+        /** The flags are kept in a bit-plane apart from the values, one bit per element in row-major order */
         void setFlagged( const Coord2D&, bool );
-        bool isFlagged( const Coord2D& ) const;
+        bool isFlagged( const Coord2D& c ) const { 
+            const std::size_t i =c.col() + c.row() * width();
+            return (m_flags[i >> 6] >> (i & 63)) & 1; 
+        }
+        /** The flags as a bit-plane, bit i holds element i in row-major order */
+        const std::vector<uint64_t>& flags() const { return m_flags; }
         void unflagAll();
 
         bool checkBounds( const Coord2D& ) const;
 
         const MassFunction& distribution( bool force_regenerate =false );
 
+        /** True if @mat has the same dimensions and values, regardless of the flags and the element width */
+        bool hasSameValues( const Matrix2D& mat ) const;
         bool operator==( const Matrix2D& );
 
     private:
+        void allocate( int bits );
+        void widen( ElementT value );
+
         unsigned int m_width, m_height, m_base;
-        ElementT* m_buffer;
+        int m_elementBits;
+        int m_rowWords;
+        std::vector<uint8_t> m_buffer;
+        std::vector<uint64_t> m_flags;
         MassFunction* m_massfunc;
 };
 
@@ -9,6 +9,7 @@
 #include "vouw.h"
 #include "matrix.h"
 #include "configuration.h"
+#include "arena.h"
 #include <vector>
 
 VOUW_NAMESPACE_BEGIN
@@ -26,7 +27,7 @@ class Pattern {
         /** Defines offsets within the pattern */
         class OffsetT : public Coord2D { 
             public:
-                OffsetT( int row =0, int col =0, int rowLength =0 );
+                OffsetT( int row =0, int col =0 );
                 OffsetT( const Coord2D& pivot1, const Coord2D& pivot2 );
 
                 Coord2D abs( const Coord2D& pivot ) const;
@@ -34,8 +35,6 @@ class Pattern {
                 OffsetT negate() const;
 
                 DirT direction() const;
-
-                int position() const override;
         };
         /** Elementary type of the pattern, tuple of offset and value */
         struct ElementT {
@@ -43,7 +42,7 @@ class Pattern {
             Matrix2D::ElementT value;
         };
         /** Container of pattern elements */
-        typedef std::vector<ElementT> ListT;
+        typedef std::vector<ElementT,ArenaAllocator<ElementT>> ListT;
         /** Defines the bouding box around the pattern and contains 
          * the total surface area a pattern spans. */
         struct BoundsT {
@@ -72,7 +71,36 @@ class Pattern {
         enum PeripheryPosition {
             AnteriorPeriphery, PosteriorPeriphery
         };
-        typedef std::vector<OffsetT> PeripheryT;
+        typedef std::vector<OffsetT,ArenaAllocator<OffsetT>> PeripheryT;
+        /** The periphery expressed as linear distances to the pivot in an InstanceMatrix */
+        typedef std::vector<int,ArenaAllocator<int>> PeripheryDeltaT;
+
+        /** The elements as bit masks over the rows of the bounding box, 64 columns per word.
+         *  Tests a pattern word by word against a bit-packed matrix, or against a bit-plane 
+         *  such as the flags of a matrix. @origin is the position of the top-left of the bounds. */
+        class MaskT {
+            public:
+                MaskT() : m_words( 0 ), m_isBinary( false ) {}
+                explicit MaskT( const Pattern& p );
+
+                bool empty() const { return m_care.empty(); }
+                /** False if a value does not fit in one bit, such that the pattern never matches a bit-packed matrix */
+                bool isBinary() const { return m_isBinary; }
+
+                /** True if the values equal those of the bit-packed @mat */
+                bool matches( const Matrix2D* mat, const Coord2D& origin ) const;
+                /** True if none of the elements is set in @plane, which has rows of @rowLength bits */
+                bool isClear( const std::vector<uint64_t>& plane, int rowLength, const Coord2D& origin ) const;
+                /** True if all of the elements are set in @plane */
+                bool isSet( const std::vector<uint64_t>& plane, int rowLength, const Coord2D& origin ) const;
+                /** Sets the elements in @plane */
+                void set( std::vector<uint64_t>& plane, int rowLength, const Coord2D& origin ) const;
+
+            private:
+                std::vector<uint64_t> m_care, m_values; // Per row of the bounds, @m_words each
+                int m_words;
+                bool m_isBinary;
+        };
 
         typedef std::pair<Pattern*,Variant*> EquivalenceT;
         typedef std::vector<EquivalenceT> EquivalenceListT;
@@ -100,7 +128,7 @@ class Pattern {
         void setLabel( int i ) { m_label =i; }
         int label() const { return m_label; }
 
-        void setActive( bool b ) { m_active =b; }
+        /** Activity is changed through CodeTable::setActive() */
         bool isActive() const { return m_active; }
 
         void setTabu( bool b ) { m_tabu =b; }
@@ -125,14 +153,25 @@ class Pattern {
         bool isAdjacent( const Pattern& p, const OffsetT& offs ) const;
         bool isInside( const OffsetT& offs ) const;
         bool isCanonical() const;
+        /** Hash of the elements in canonical pivot form, i.e. relative to the first element.
+         *  Equal for patterns with the same elements, regardless of the position of their pivots */
+        uint64_t contentHash() const;
+        /** Returns true if @p has the same elements as this pattern, up to a translation */
+        bool hasSameElements( const Pattern& p ) const;
 
         /* Functions that apply or test a pattern against a matrix */
 
+        /** Tests the values and flags of @mat at @pivot. Computes the mask form on first use, 
+         *  such that concurrent tests should use a MaskT of their own */
         bool test( Matrix2D* mat, const Coord2D& pivot, bool isEqual =true, bool isFlagged =false, bool isUnflagged =true );
+        /** Position of the top-left of the bounds when the pattern is at @pivot */
+        Coord2D origin( const Coord2D& pivot ) const { return Coord2D( pivot.row() + m_bounds.rowMin, pivot.col() + m_bounds.colMin ); }
         void apply( Matrix2D* mat, const Coord2D& pivot, bool setValue =true, bool flag =false, bool unflag =false );
 
         /* Functions that interact with the pattern's periphery */
         const PeripheryT& periphery( PeripheryPosition p = AnteriorPeriphery ) const;
+        /** Returns the periphery as offsets that can be added to the key of the pivot in an InstanceMatrix */
+        const PeripheryDeltaT& peripheryDelta( PeripheryPosition p = AnteriorPeriphery ) const { return m_peripheryDelta[p]; }
 
         /** Returns a reference to the list of elements */
         ListT& elements() { return m_elements; }
@@ -149,9 +188,24 @@ class Pattern {
 
         void debugPrint() const;
 
+        /* Functions that manage the storage of the elements and periphery */
+
+        /** Moves the elements and periphery to exactly sized arrays in @arena */
+        void moveToArena( Arena* arena );
+        /** Frees the elements and periphery. The pattern is left without elements and can only
+         *  be used for its code length and bookkeeping afterwards */
+        void release();
+        bool isReleased() const { return m_elements.empty(); }
+        /** Number of bytes used by the elements and periphery */
+        std::size_t storageSize() const;
+
     private:
+        friend class CodeTable;
+        void setActive( bool b ) { m_active =b; }
         void unionAdd( const Pattern& p1, const Pattern& p2, const OffsetT& );
         void recomputePeriphery();
+        void recomputePeripheryDelta();
+        template<typename T> bool testValues( const T* buffer, int rowLength, const Coord2D& pivot ) const;
         ListT m_elements;
         BoundsT m_bounds;
         int m_usage;
@@ -164,6 +218,9 @@ class Pattern {
         bool m_tabu;
         CompositionT m_composition;
         PeripheryT m_periphery[2];
+        PeripheryDeltaT m_peripheryDelta[2];
+        /** Computed on first use by test(), empty until then */
+        MaskT m_mask;
         ConfigIDT m_config;
 };
 
@@ -0,0 +1,82 @@
+/*
+ * VOUW - Spatial, compression-based pattern mining on matrices
+ *
+ * Micky Faas <micky@edukitty.org>
+ * (C) 2017, 2018, 2019, Leiden Institute for Advanced Computer Science
+ */
+
+#pragma once
+#include "vouw.h"
+#include "matrix.h"
+#include "configuration.h"
+#include "pattern.h"
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+VOUW_NAMESPACE_BEGIN
+
+/** Finds all pivots at which a set of patterns matches the values of a matrix, regardless of the flags.
+ *  Every window of the matrix is hashed as a polynomial over its rows and columns, computed in constant
+ *  time per run of adjacent elements from prefix sums over the rows of the matrix (Rabin-Karp in 2D).
+ *  Patterns with the same Configuration share a single pass over the matrix and are looked up by hash;
+ *  every hit is verified against the matrix, so the matches are exact. A bit-packed matrix is verified
+ *  with the mask form of the pattern, a row of 64 columns at a time.
+ *  The windows are divided in bands of rows that are searched by separate threads. */
+class PatternMatcher {
+    public:
+        typedef std::vector<Coord2D> PivotVectorT;
+
+        /** @mat should not be changed while the matcher is used */
+        PatternMatcher( const Matrix2D* mat, int threadCount =1 );
+
+        /** Adds @p to the patterns that are searched for and returns its index */
+        int add( const Pattern* p );
+        int size() const { return m_patterns.size(); }
+
+        /** Searches for all patterns that have been added */
+        void run();
+
+        /** The pivots at which the pattern with index @i matches, in row-major order */
+        const PivotVectorT& matches( int i ) const { return m_matches[i]; }
+        /** The mask form of the pattern with index @i, to test it against bit-planes */
+        const Pattern::MaskT& mask( int i ) const { return m_masks[i]; }
+        /** Number of equal hashes that turned out not to be a match */
+        std::size_t collisions() const { return m_collisions; }
+
+    private:
+        /** A horizontal run of adjacent elements of a configuration, columns [@begin,@end) */
+        struct RunT {
+            int row, begin, end;
+        };
+        /** The patterns with the same configuration, searched for in a single pass */
+        struct GroupT {
+            std::vector<RunT> runs;
+            int width, height;
+            std::unordered_multimap<uint64_t,int> index; // Hash of the elements to pattern index
+        };
+        /** The matches found by one thread over a band of rows */
+        struct BandT {
+            std::vector<PivotVectorT> matches; // By pattern index
+            std::size_t collisions;
+        };
+
+        void computePrefixRows( int rowBegin, int rowEnd );
+        void searchBand( int rowBegin, int rowEnd, BandT* band ) const;
+        bool verify( int idx, const Coord2D& pivot ) const;
+
+        const Matrix2D* m_mat;
+        int m_threadCount;
+        std::vector<const Pattern*> m_patterns;
+        std::vector<Pattern::MaskT> m_masks; // Computed by add(), such that the threads only read them
+        std::vector<GroupT> m_groups;
+        ConfigurationRegistry m_configs; // Id of a configuration is the index of its group
+        /** Prefix sums of the hashed values of each row, weighed by powers of the column base,
+         *  width()+1 per row */
+        std::vector<uint64_t> m_prefix;
+        std::vector<uint64_t> m_colPow, m_colPowInv, m_rowPow;
+        std::vector<PivotVectorT> m_matches;
+        std::size_t m_collisions;
+};
+
+VOUW_NAMESPACE_END
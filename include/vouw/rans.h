@@ -0,0 +1,79 @@
+/*
+ * VOUW - Spatial, compression-based pattern mining on matrices
+ *
+ * Micky Faas <micky@edukitty.org>
+ * (C) 2017, 2018, 2019, Leiden Institute for Advanced Computer Science
+ */
+
+#pragma once
+#include "vouw.h"
+#include <vector>
+#include <istream>
+#include <ostream>
+#include <cstdint>
+#include <cstddef>
+
+VOUW_NAMESPACE_BEGIN
+
+/* Symbols are coded as an interval [start,start+freq) of [0,RANS_SCALE) */
+#define RANS_SCALE_BITS 31
+#define RANS_SCALE (1ULL << RANS_SCALE_BITS)
+
+/** Maps the cumulative count @cum out of @total to [0,RANS_SCALE).
+ *  Consecutive counts map to intervals of at least one, as long as @total <= RANS_SCALE */
+inline uint32_t ransScale( uint64_t cum, uint64_t total ) { return (uint32_t)((cum << RANS_SCALE_BITS) / total); }
+/** Inverse of ransScale(): the largest count of which the scaled value does not exceed @slot */
+inline uint64_t ransUnscale( uint32_t slot, uint64_t total ) { return (((uint64_t)slot + 1) * total - 1) >> RANS_SCALE_BITS; }
+
+/** Encoder of the range variant of asymmetric numeral systems, with a 64-bit state that is renormalized
+ *  in 32-bit words. rANS codes in reverse, therefore the symbols are collected first and coded in flush(). */
+class RansEncoder {
+    public:
+        RansEncoder() : m_bits( 0.0 ) {}
+
+        void put( uint32_t start, uint32_t freq );
+        /** @v out of @n equally likely values, @n <= RANS_SCALE */
+        void putUniform( uint32_t v, uint32_t n );
+        /** An unsigned integer of any size, in about 2 log2(@v) + 5 bits */
+        void putUInt( uint32_t v );
+
+        std::size_t size() const { return m_symbols.size(); }
+        /** The information content of the symbols, the size of the output minus the overhead of the coder */
+        double bits() const { return m_bits; }
+
+        /** Writes the coded symbols to @os and returns the number of bytes written */
+        std::size_t flush( std::ostream& os );
+
+    private:
+        std::vector<uint64_t> m_symbols; // Start in the upper, frequency in the lower half
+        double m_bits;
+};
+
+/** Decoder for the output of RansEncoder. The input is read in blocks as it is needed,
+ *  at most @length bytes are taken from the stream. */
+class RansDecoder {
+    public:
+        RansDecoder( std::istream& is, uint64_t length );
+
+        /** The slot of the next symbol, of which the interval is to be passed to advance() */
+        uint32_t peek() const { return (uint32_t)(m_state & (RANS_SCALE - 1)); }
+        void advance( uint32_t start, uint32_t freq );
+        /** A value in [0,@n), fails if @n is zero */
+        uint32_t getUniform( uint32_t n );
+        uint32_t getUInt();
+
+        /** False if the input has ended prematurely or could not have been coded */
+        bool isValid() const { return m_valid; }
+
+    private:
+        uint32_t readWord();
+
+        std::istream& m_is;
+        uint64_t m_remaining;
+        uint64_t m_state;
+        std::vector<char> m_buffer;
+        std::size_t m_pos, m_end;
+        bool m_valid;
+};
+
+VOUW_NAMESPACE_END
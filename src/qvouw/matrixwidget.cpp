@@ -213,8 +213,9 @@ MatrixWidget::paintEvent( QPaintEvent *event ) {
     /* Render the widget depending on the type of content */
     if( mode == InputMatrix ) {
 
+        std::vector<Vouw::Matrix2D::ElementT> row( data.mat->width() );
         for( int i = (int)clip.top(); i < qMin(data.mat->height(), (unsigned int)clip.bottom()+1); ++i ) {    
-            Vouw::Matrix2D::ElementT *row = data.mat->rowPtr( i );
+            data.mat->readRow( i, row.data() );
 
             for( int j = (int)clip.left(); j < qMin(data.mat->width(), (unsigned int)clip.right()+1); ++j ) {
                 QRectF rect( j+stroke, i+stroke, 1-stroke, 1-stroke );
@@ -241,7 +242,7 @@ MatrixWidget::paintEvent( QPaintEvent *event ) {
     } else { 
 
         QMap<int, QPolygonF> patternPoly;
-        const Vouw::Instance* selectedInstance =NULL;
+        Vouw::Instance selectedInstance;
 
         for( auto&& instance : *data.enc->instanceSet() ) {
             if( instance.empty() ) continue;
@@ -303,7 +304,7 @@ REDRAW_PATTERN:
                 painter.drawPolygon( poly );
             }
             if( isSelected ) {
-                selectedInstance =&instance;
+                selectedInstance =instance;
             }
             if( opts & ShowPivots ) {
                 QPointF center( instance.pivot().col() + 0.5, instance.pivot().row() + 0.5 );
@@ -312,14 +313,14 @@ REDRAW_PATTERN:
             }
         }
         // Additionally, we draw the periphery of the selected instance
-        if( selectedInstance && opts & ShowPeriphery ) {
+        if( !selectedInstance.empty() && opts & ShowPeriphery ) {
             // There are multiple peripheries (before and after the instance)
             for( int i =0; i < 2; i++ ) {
                 const Vouw::Pattern::PeripheryT& per 
-                    =selectedInstance->pattern()->periphery( (Vouw::Pattern::PeripheryPosition)i );
+                    =selectedInstance.pattern()->periphery( (Vouw::Pattern::PeripheryPosition)i );
                 painter.setPen( QPen( i == 0 ? Qt::red : Qt::black,stroke ) );
                 for( auto &&offset : per ) {
-                    Vouw::Coord2D c = offset.abs( selectedInstance->pivot() );
+                    Vouw::Coord2D c = offset.abs( selectedInstance.pivot() );
                     drawCross( painter, QPoint( c.col(), c.row() ) );
                 }
             }
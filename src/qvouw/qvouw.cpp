@@ -33,7 +33,7 @@ namespace QVouw {
 
         Vouw::Matrix2D *mat = new Vouw::Matrix2D( gray.width(), gray.height(), levels2 );
         for( int i =0; i < N; i++ )
-            mat->data()[i] = gray.bits()[i] >> shift;
+            mat->setValue( Vouw::Coord2D( i / gray.width(), i % gray.width() ), gray.bits()[i] >> shift );
 
         std::cerr << std::flush;
         std::cout << std::flush;
@@ -8,6 +8,7 @@
 #include <vouw/vouw.h>
 #include <vouw/encoder.h>
 #include <vouw/codetable.h>
+#include <vouw/codec.h>
 
 #include <unistd.h>
 #include <cstdio>
@@ -17,6 +18,7 @@
 #include <iomanip>
 #include <cmath>
 #include <iostream>
+#include <fstream>
 #include <chrono>
 
 typedef std::chrono::high_resolution_clock::time_point TimeVarT;
@@ -31,20 +33,25 @@ typedef std::chrono::high_resolution_clock::time_point TimeVarT;
 struct Opts {
     int repeats;
     std::string outFilename, diffFilename;
-    bool encode, diff;
+    std::string containerPath, containerFilename;
+    bool encode, diff, fixedModel;
     char separator;
     double maxErr;
 };
 
-static struct Opts OPTS_DEFAULTS = {1,"","",false,false,'\t',.25};
+static struct Opts OPTS_DEFAULTS = {1,"","","","",false,false,false,'\t',.25};
 
 struct VouwOpts {
     Vouw::Encoder::LocalSearch ls;
     Vouw::Encoder::Heuristic heur;
     bool tabu;
+    Vouw::Encoder::CandidateSearch cs;
+    Vouw::Encoder::CandidateSelection sel;
+    int threads;
+    bool verify;
 };
 
-static struct VouwOpts VOUWOPTS_DEFAULTS = { Vouw::Encoder::FloodFill, Vouw::Encoder::BestN, false };
+static struct VouwOpts VOUWOPTS_DEFAULTS = { Vouw::Encoder::FloodFill, Vouw::Encoder::BestN, false, Vouw::Encoder::FullSearch, Vouw::Encoder::SortedSelection, 1, false };
 
 void
 printHelp( const char* exec ) {
@@ -60,6 +67,8 @@ General options:\n\
 \t-s\tSet separator character for printing statistics (defaults to tab).\n\
 \t-b\tMaximum error factor in size/usage when counting patterns (statistics only).\n\
 \t-d\tAlso write the difference between the generated matrix and the VOUW encoded result (needs -e and -o).\n\
+\t-m\tEncode the first matrix using VOUW and the others using its code table as a fixed model (needs -e).\n\
+\t-c\tWrite the encoded matrices to a VOUW container with the specified filename and decode it again (needs -e).\n\
 \t-h\tPrint this information.\n\
 Options to RIL (specify using -r)\n\
 \tw=\tWidth (number of columns) of the generated matrix.\n\
@@ -75,6 +84,10 @@ Options to VOUW (specify using -v)\n\
 \tb1\tUse 'Best 1' heuristic.\n\
 \tbn\tUse 'Best N' heuristic.\n\
 \tt \tDisregard background ('tabu' mode).\n\
+\ti=\tRebuild the candidates every iteration (0, default) or update them incrementally (1).\n\
+\tl=\tEvaluate the gain of all candidates (0, default) or only as needed, using an upper bound (1).\n\
+\tc \tVerify the incrementally updated code lengths after each merge and the lazy selection (debug only).\n\
+\tj=\tNumber of threads used to count and evaluate the candidates (1 by default).\n\
 ", exec );
 }
 
@@ -185,6 +198,27 @@ parseVOUWArg( VouwOpts& vopts, const char *arg ) {
         case 't':
             vopts.tabu =true;
             break;
+        case 'c':
+            vopts.verify =true;
+            break;
+        case 'i': 
+            {
+                int inc;
+                bool b =argInt( inc, arg );
+                if( b ) 
+                    vopts.cs = inc ? Vouw::Encoder::IncrementalSearch : Vouw::Encoder::FullSearch;
+                return b;
+            }
+        case 'l': 
+            {
+                int lazy;
+                bool b =argInt( lazy, arg );
+                if( b ) 
+                    vopts.sel = lazy ? Vouw::Encoder::LazySelection : Vouw::Encoder::SortedSelection;
+                return b;
+            }
+        case 'j':
+            return argInt( vopts.threads, arg );
         default:
             return false;
     }
@@ -218,20 +252,81 @@ setFilenameNumber( const std::string filename, int n, int total, std::string pos
 }
 
 
+/** Writes the encoding @e of @mat to a container at @path and decodes it again.
+ *  Prints the throughput and the actual size compared to the estimated size */
+bool
+writeContainer( const Vouw::Encoder& e, const Vouw::Matrix2D* mat, const std::string& path ) {
+    Vouw::CodecWriter writer;
+    TimeVarT start =TIMENOW();
+    std::ofstream out( path, std::ios::binary );
+    if( !out || !writer.write( e, out ) ) {
+        fprintf( stderr, "Error: could not write to given path `%s'\n", path.c_str() );
+        return false;
+    }
+    out.close();
+    TimeVarT stop  =TIMENOW();
+    const double encodeTime =std::chrono::duration<double>( stop-start ).count();
+
+    start =TIMENOW();
+    std::ifstream in( path, std::ios::binary );
+    Vouw::CodecReader reader( in );
+    Vouw::Matrix2D* decoded =reader.readMatrix();
+    const bool isLossless =decoded && decoded->hasSameValues( *mat );
+    delete decoded;
+    stop  =TIMENOW();
+    const double decodeTime =std::chrono::duration<double>( stop-start ).count();
+
+    // Throughput in terms of the size of the matrix in memory
+    const double megabytes =(double)mat->count() * mat->elementBits() / 8.0 / 1e6;
+    const double actualBits =writer.bytes() * 8.0;
+    fprintf( stderr, "Container: %lu bytes, estimated %.0f bits, actual %.0f bits (%+.2f%%), encoded at %.1f MB/s, decoded at %.1f MB/s, %s\n",
+            (unsigned long)writer.bytes(), e.compressedSize(), actualBits, 100.0 * (actualBits - e.compressedSize()) / e.compressedSize(),
+            megabytes / encodeTime, megabytes / decodeTime, isLossless ? "equal to the input." : "NOT equal to the input!" );
+    return isLossless;
+}
+
+/** Encodes @mat, using the code table of @model if it is set. With the fixed model option, 
+ *  the first encoder is kept as @model for the following matrices */
 bool
-encode( Vouw::Matrix2D* mat, Statistics::Sample& s, const Opts& opts, const RilOpts& ropts, const VouwOpts& vopts ) {
-    Vouw::Encoder e;
+encode( Vouw::Matrix2D* mat, Statistics::Sample& s, const Opts& opts, const RilOpts& ropts, const VouwOpts& vopts, Vouw::Encoder*& model ) {
+    Vouw::Encoder* ep =new Vouw::Encoder();
+    Vouw::Encoder& e =*ep;
 
-    e.setFromMatrix( mat, vopts.tabu );
     e.setLocalSearchMode( vopts.ls );
     e.setHeuristic( vopts.heur );
-
-    TimeVarT start =TIMENOW();
-    e.encode();
-    TimeVarT stop  =TIMENOW();
+    e.setCandidateSearchMode( vopts.cs );
+    e.setCandidateSelectionMode( vopts.sel );
+    e.setThreadCount( vopts.threads );
+    e.setVerifyCodeLengths( vopts.verify );
+    e.setVerifySelection( vopts.verify );
+
+    TimeVarT start, stop;
+    if( model ) {
+        start =TIMENOW();
+        e.setFromMatrixUsing( mat, model->codeTable() );
+        stop  =TIMENOW();
+        fprintf( stderr, "Fixed model: L(D|CT) = %.1f bits, compression ratio %.4f\n", e.dataSize(), e.ratio() );
+    } else {
+        e.setFromMatrix( mat, vopts.tabu );
+        start =TIMENOW();
+        e.encode();
+        stop  =TIMENOW();
+    }
 
     s.total_time =DURATION(stop-start);
 
+    // The encoding should reproduce the input exactly
+    start =TIMENOW();
+    Vouw::Matrix2D* decoded =e.decode();
+    const bool isLossless =decoded && decoded->hasSameValues( *mat );
+    delete decoded;
+    stop  =TIMENOW();
+    fprintf( stderr, "Decoded in %ld ms, %s\n", (long)DURATION(stop-start), isLossless ? "equal to the input." : "NOT equal to the input!" );
+    if( !isLossless || (!opts.containerFilename.empty() && !writeContainer( e, mat, opts.containerFilename )) ) {
+        delete ep;
+        return false;
+    }
+
     Vouw::Matrix2D *diff =nullptr;
 
     if( opts.diff )
@@ -246,6 +341,11 @@ encode( Vouw::Matrix2D* mat, Statistics::Sample& s, const Opts& opts, const RilO
         }
         delete diff;
     }
+
+    if( opts.fixedModel && !model )
+        model =ep;
+    else
+        delete ep;
     
     return true;
 }
@@ -264,7 +364,7 @@ main( int argc, char **argv ) {
     Opts opts      = OPTS_DEFAULTS;
 
     int opt;
-    while( (opt = getopt( argc, argv, "dev:r:n:f:o:s:b:h" )) != -1 ) {
+    while( (opt = getopt( argc, argv, "demv:r:n:f:o:c:s:b:h" )) != -1 ) {
         switch( opt ) {
             case 'e':
                 opts.encode =true;
@@ -290,6 +390,9 @@ main( int argc, char **argv ) {
             case 'o':
                 opts.outFilename = std::string( optarg );
                 break;
+            case 'c':
+                opts.containerPath = std::string( optarg );
+                break;
             case 's':
                 opts.separator = optarg[0];
                 break;
@@ -299,6 +402,9 @@ main( int argc, char **argv ) {
             case 'd':
                 opts.diff =true;
                 break;
+            case 'm':
+                opts.fixedModel =true;
+                break;
             case 'h':
             default:
                 printHelp( argv[0] );
@@ -334,6 +440,14 @@ main( int argc, char **argv ) {
         fprintf( stderr, "%s: Write difference (-d) required encode (-e) and output path (-o).\n", argv[0] );
         return -1;
     }
+    if( !opts.containerPath.empty() && !opts.encode ) {
+        fprintf( stderr, "%s: Write container (-c) requires encode (-e).\n", argv[0] );
+        return -1;
+    }
+    if( opts.fixedModel && !opts.encode ) {
+        fprintf( stderr, "%s: Fixed model (-m) requires encode (-e).\n", argv[0] );
+        return -1;
+    }
 
     registerBuiltinWriters();
 
@@ -345,6 +459,7 @@ main( int argc, char **argv ) {
 
     Statistics stats;
     stats.setSeparatorChar( opts.separator );
+    Vouw::Encoder* model =nullptr;
     int err =0;
 
     //Ril r( ropts );
@@ -354,6 +469,7 @@ main( int argc, char **argv ) {
         ropts.outFilename =setFilenameNumber( opts.outFilename, i+1, opts.repeats );
         if( opts.diff )
             opts.diffFilename =setFilenameNumber( opts.outFilename, i+1, opts.repeats, "_diff" );
+        opts.containerFilename =setFilenameNumber( opts.containerPath, i+1, opts.repeats );
         Statistics::Sample s = {0};
         Ril ril ( ropts );
         if( !ril.generate() ) {
@@ -366,7 +482,7 @@ main( int argc, char **argv ) {
         s.snr_in        =ril.effectiveSNR();
 
         if( opts.encode ) {
-            if( !encode( ril.matrix(), s, opts, ropts, vopts ) ) {
+            if( !encode( ril.matrix(), s, opts, ropts, vopts, model ) ) {
                 err =-1; break;
             }
         }
@@ -375,6 +491,7 @@ main( int argc, char **argv ) {
 
     if( opts.encode )
         stats.print();
+    delete model;
 
     MatrixWriter::destroy();
 
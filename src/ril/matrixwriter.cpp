@@ -9,6 +9,7 @@
 #include <stdexcept>     
 #include <fstream>
 #include <iostream>
+#include <vector>
 #include <vouw/massfunction.h>
 
 // MatrixWriter
@@ -72,11 +73,14 @@ PGMWriter::writeMatrix( Vouw::Matrix2D& mat, const std::string& path ) {
 
     file << "P5\n" << mat.width() << " " << mat.height() << "\n" << dist.upperBound()-floor << "\n";
 
-    // Matrix2D stores its data as uint32_t so we cannot write it directly
-    // Therefore we use the slow per-byte method
-    for( int i =0; i < mat.count(); i++ ) {
-        char c =(char)((mat.data()[i] & ~VOUW_UNODE32_FLAGGED) - floor);
-        file.write( &c, sizeof(char) );
+    // Matrix2D may store its data wider than a byte, we write it row by row
+    std::vector<Vouw::Matrix2D::ElementT> values( mat.width() );
+    std::vector<char> row( mat.width() );
+    for( int i =0; i < mat.height(); i++ ) {
+        mat.readRow( i, values.data() );
+        for( int j =0; j < mat.width(); j++ )
+            row[j] =(char)(values[j] - floor);
+        file.write( row.data(), row.size() );
     }
 
     file.close();
@@ -44,7 +44,7 @@ Direction::ccwTurn() {
 
 Vouw::Coord2D 
 Direction::stepOnce( const Vouw::Coord2D& coord ) const {
-    return Vouw::Coord2D( coord.row() + DIRSTEP[d][1], coord.col() + DIRSTEP[d][0], coord.rowLength() );
+    return Vouw::Coord2D( coord.row() + DIRSTEP[d][1], coord.col() + DIRSTEP[d][0] );
 }
 
 Ril::~Ril() {
@@ -78,11 +78,14 @@ Ril::generate() {
     }
     
     if( ropts.parms.noise ) {
-        Vouw::Matrix2D::ElementT *e =mat->data();
-        for( int i =0; i < mat->count(); i++ ) {
-            if( !((*e) & VOUW_UNODE32_FLAGGED) )
-                (*e) =noise_dist(rgen);
-            e++;
+        std::vector<Vouw::Matrix2D::ElementT> row( mat->width() );
+        for( int i =0; i < mat->height(); i++ ) {
+            mat->readRow( i, row.data() );
+            for( int j =0; j < mat->width(); j++ ) {
+                if( !mat->isFlagged( Vouw::Coord2D( i, j ) ) )
+                    row[j] =noise_dist(rgen);
+            }
+            mat->writeRow( i, row.data() );
         }
     }
     
@@ -377,7 +380,7 @@ Ril::randEmptyCoord( Vouw::Coord2D& coord ) {
     std::uniform_int_distribution<int> cdist(0,ropts.cols-1);
 
     for( int i =0; i < 1000000; i++ ) { // TODO: fix this wtf
-        Vouw::Coord2D c( rdist(rgen), cdist(rgen), ropts.cols );
+        Vouw::Coord2D c( rdist(rgen), cdist(rgen) );
         if( mat->isFlagged( c ) == false ) {
             coord =c;
             //printf( "(%d,%d)\n", c.col(), c.row() );
@@ -16,7 +16,7 @@
 
 /** Test whether a pattern fits the requirements of a pattern that we expect to find given the input data */
 bool
-patternIsExpected( const Vouw::Pattern* p, double maxErr, const RilOpts& ropts ) {
+patternIsExpected( const Vouw::Encoder& e, const Vouw::Pattern* p, double maxErr, const RilOpts& ropts ) {
 
     if( !p->isActive() ) return false;
     if( p->size() == 1 ) return false; // Singleton
@@ -24,8 +24,9 @@ patternIsExpected( const Vouw::Pattern* p, double maxErr, const RilOpts& ropts )
     ||  p->size() > ((double)ropts.parms.maxSize + (double)ropts.parms.maxSize * maxErr) )
         return false;
     
-    if( p->usage() < ((double)ropts.parms.minUsage - (double)ropts.parms.minUsage * maxErr)
-    ||  p->usage() > ((double)ropts.parms.maxUsage + (double)ropts.parms.maxUsage * maxErr) )
+    // A fixed model does not store the usage in its patterns
+    if( e.usage( p ) < ((double)ropts.parms.minUsage - (double)ropts.parms.minUsage * maxErr)
+    ||  e.usage( p ) > ((double)ropts.parms.maxUsage + (double)ropts.parms.maxUsage * maxErr) )
         return false;
 
     return true;
@@ -38,7 +39,7 @@ Statistics::processResult( Sample& s, const Vouw::Encoder& e, const Vouw::Matrix
     s.compression =e.ratio();
 
     // Let's count the patterns
-    auto f =std::bind( patternIsExpected, std::placeholders::_1, maxErr, ropts );
+    auto f =std::bind( patternIsExpected, std::cref( e ), std::placeholders::_1, maxErr, ropts );
 
     s.patterns_out =std::count_if( e.codeTable()->begin(), e.codeTable()->end(), f );
     s.patterns_out_total =e.codeTable()->countIfActiveNonSingleton();
@@ -51,7 +52,7 @@ Statistics::processResult( Sample& s, const Vouw::Encoder& e, const Vouw::Matrix
     for( int i =0; i < mat->height(); i++ )
         for( int j =0; j < mat->width(); j++ ) {
 
-            Vouw::Coord2D c( i,j,mat->width() );
+            Vouw::Coord2D c( i,j );
             bool inputIsSignal = mat->isFlagged( c );
 
             Vouw::InstanceVector::IndexT it =e.instanceMatrix()[c];
@@ -0,0 +1,60 @@
+/*
+ * VOUW - Spatial, compression-based pattern mining on matrices
+ *
+ * Micky Faas <micky@edukitty.org>
+ * (C) 2017, 2018, 2019, Leiden Institute for Advanced Computer Science
+ */
+
+#include <vouw/arena.h>
+#include <cstdint>
+
+VOUW_NAMESPACE_BEGIN
+
+Arena::Arena( std::size_t slabSize ) 
+    : m_ptr( nullptr ), m_left( 0 ), m_slabSize( slabSize ), m_size( 0 ), m_capacity( 0 ) {}
+
+Arena::~Arena() {
+    clear();
+}
+
+void*
+Arena::allocate( std::size_t bytes, std::size_t align ) {
+    std::size_t pad =(align - (std::uintptr_t)m_ptr % align) % align;
+    if( !m_ptr || pad + bytes > m_left ) {
+        // Allocations that do not fit a regular slab get one of their own
+        if( bytes + align > m_slabSize ) {
+            char* slab =addSlab( bytes + align );
+            pad =(align - (std::uintptr_t)slab % align) % align;
+            m_size += bytes;
+            return slab + pad;
+        }
+        m_ptr =addSlab( m_slabSize );
+        m_left =m_slabSize;
+        pad =(align - (std::uintptr_t)m_ptr % align) % align;
+    }
+    char* p =m_ptr + pad;
+    m_ptr += pad + bytes;
+    m_left -= pad + bytes;
+    m_size += bytes;
+    return p;
+}
+
+void
+Arena::clear() {
+    for( auto slab : m_slabs ) delete[] slab;
+    m_slabs.clear();
+    m_ptr =nullptr;
+    m_left =m_size =m_capacity =0;
+}
+
+/* Private functions */
+
+char*
+Arena::addSlab( std::size_t bytes ) {
+    char* slab =new char[bytes];
+    m_slabs.push_back( slab );
+    m_capacity += bytes;
+    return slab;
+}
+
+VOUW_NAMESPACE_END
@@ -0,0 +1,169 @@
+/*
+ * VOUW - Spatial, compression-based pattern mining on matrices
+ *
+ * Micky Faas <micky@edukitty.org>
+ * (C) 2017, 2018, 2019, Leiden Institute for Advanced Computer Science
+ */
+
+#include <vouw/candidate_table.h>
+#include <vouw/equivalence.h>
+#include <cassert>
+#include <algorithm>
+
+VOUW_NAMESPACE_BEGIN
+
+static const std::size_t npos =-1;
+
+CandidateTable::CandidateTable() : m_size( 0 ), m_mask( 0 ) {}
+
+CandidateKey
+CandidateTable::key( const Candidate& c ) {
+    assert( c.offset.row() >= 0 && c.offset.row() <= UINT16_MAX );
+
+    const int l1 =c.p1->label(), l2 =c.p2->label();
+    const int lmax =std::max( l1, l2 );
+    if( lmax >= m_patterns.size() ) m_patterns.resize( lmax+1, nullptr );
+    m_patterns[l1] =c.p1;
+    m_patterns[l2] =c.p2;
+
+    CandidateKey k = { (uint32_t)l1, (uint32_t)l2,
+                       c.offset.col(), (uint16_t)c.offset.row(),
+                       variantId( c.v1 ), variantId( c.v2 ) };
+    return k;
+}
+
+Candidate
+CandidateTable::candidate( const CandidateKey& k ) const {
+    Candidate c = { m_patterns[k.label1], m_patterns[k.label2],
+                    m_variants[k.variant1], m_variants[k.variant2],
+                    Pattern::OffsetT( k.row, k.col ) };
+    return c;
+}
+
+void
+CandidateTable::add( const CandidateKey& k, int n ) {
+    if( (m_size + 1) * 5 > m_slots.size() * 4 )
+        rehash( std::max<std::size_t>( 64, m_slots.size() * 2 ) );
+
+    EntryT e = { k, n, 1 };
+    std::size_t i =hash( k ) & m_mask;
+    bool displaced =false;
+
+    while( true ) {
+        EntryT& s =m_slots[i];
+        if( !s.probe ) {
+            s =e;
+            m_size++;
+            return;
+        }
+        // Once we have displaced another entry, @k has been inserted
+        if( !displaced && s.probe == e.probe && s.key == k ) {
+            s.count += n;
+            return;
+        }
+        if( s.probe < e.probe ) {
+            std::swap( s, e );
+            displaced =true;
+        }
+        e.probe++;
+        i =(i+1) & m_mask;
+    }
+}
+
+void
+CandidateTable::subtract( const CandidateKey& k, int n ) {
+    std::size_t i =find( k );
+    if( i == npos ) return;
+    if( (m_slots[i].count -= n) > 0 ) return;
+
+    // Backward shift: move the following entries one slot closer to their home
+    std::size_t j =(i+1) & m_mask;
+    while( m_slots[j].probe > 1 ) {
+        m_slots[i] =m_slots[j];
+        m_slots[i].probe--;
+        i =j;
+        j =(j+1) & m_mask;
+    }
+    m_slots[i].probe =0;
+    m_size--;
+}
+
+int
+CandidateTable::count( const CandidateKey& k ) const {
+    std::size_t i =find( k );
+    return i == npos ? 0 : m_slots[i].count;
+}
+
+void
+CandidateTable::reset( std::size_t expected ) {
+    std::size_t capacity =64;
+    while( capacity * 4 < expected * 5 ) capacity *= 2;
+    m_slots.assign( capacity, EntryT() );
+    m_mask =capacity - 1;
+    m_size =0;
+}
+
+void
+CandidateTable::reserve( std::size_t n ) {
+    std::size_t capacity =std::max<std::size_t>( 64, m_slots.size() );
+    while( capacity * 4 < n * 5 ) capacity *= 2;
+    if( capacity != m_slots.size() )
+        rehash( capacity );
+}
+
+void
+CandidateTable::clear() {
+    m_slots.clear();
+    m_mask =0;
+    m_size =0;
+    m_patterns.clear();
+    m_variants.clear();
+    m_variantHashes.clear();
+    m_variantAliases.clear();
+}
+
+/* Private functions */
+
+uint8_t
+CandidateTable::variantId( Variant* v ) {
+    // Virtually all candidates use the same few variants, which we recognize by address
+    for( auto&& alias : m_variantAliases )
+        if( alias.first == v ) return alias.second;
+
+    const int h =v->hash();
+    auto it =std::find( m_variantHashes.begin(), m_variantHashes.end(), h );
+    uint8_t id =it - m_variantHashes.begin();
+    if( it == m_variantHashes.end() ) {
+        assert( m_variants.size() <= UINT8_MAX );
+        m_variants.push_back( v );
+        m_variantHashes.push_back( h );
+    }
+    m_variantAliases.push_back( std::make_pair( v, id ) );
+    return id;
+}
+
+void
+CandidateTable::rehash( std::size_t capacity ) {
+    std::vector<EntryT> old;
+    old.swap( m_slots );
+    m_slots.assign( capacity, EntryT() );
+    m_mask =capacity - 1;
+    m_size =0;
+    for( auto&& e : old )
+        if( e.probe ) add( e.key, e.count );
+}
+
+std::size_t
+CandidateTable::find( const CandidateKey& k ) const {
+    if( m_slots.empty() ) return npos;
+    std::size_t i =hash( k ) & m_mask;
+    for( uint32_t probe =1; ; probe++ ) {
+        const EntryT& s =m_slots[i];
+        // Entries are ordered by their distance to home, we can stop early
+        if( s.probe < probe ) return npos;
+        if( s.probe == probe && s.key == k ) return i;
+        i =(i+1) & m_mask;
+    }
+}
+
+VOUW_NAMESPACE_END
@@ -0,0 +1,401 @@
+/*
+ * VOUW - Spatial, compression-based pattern mining on matrices
+ *
+ * Micky Faas <micky@edukitty.org>
+ * (C) 2017, 2018, 2019, Leiden Institute for Advanced Computer Science
+ */
+
+#include <vouw/codec.h>
+#include <vouw/encoder.h>
+#include <vouw/codetable.h>
+#include <vouw/pattern.h>
+#include <vouw/instance.h>
+#include <vouw/equivalence.h>
+#include <algorithm>
+#include <sstream>
+#include <cstring>
+#include <cstdio>
+
+VOUW_NAMESPACE_BEGIN
+
+/* The weights of the adaptive code are counted in units of the pseudo count, which should divide one */
+static const uint32_t s_weightStep =(uint32_t)(1.0 / pseudoCount + .5);
+
+static void
+writeInt( std::ostream& os, uint64_t v, int bytes ) {
+    for( int i =0; i < bytes; i++ )
+        os.put( (char)((v >> (8*i)) & 0xff) );
+}
+
+static uint64_t
+readInt( const unsigned char* buffer, int bytes ) {
+    uint64_t v =0;
+    for( int i =0; i < bytes; i++ )
+        v |= (uint64_t)buffer[i] << (8*i);
+    return v;
+}
+
+/* class AdaptiveCode implementation */
+
+AdaptiveCode::AdaptiveCode( int n ) : m_tree( n + 1, 0 ), m_total( n ), m_highBit( 1 ) {
+    // All weights start at one, node i holds the sum over (i - lowbit(i), i]
+    for( int i =1; i <= n; i++ ) m_tree[i] =i & -i;
+    while( m_highBit * 2 <= n ) m_highBit *= 2;
+}
+
+void
+AdaptiveCode::put( RansEncoder& enc, int s ) {
+    const uint64_t low =prefix( s ), high =prefix( s + 1 );
+    const uint32_t start =ransScale( low, m_total );
+    enc.put( start, ransScale( high, m_total ) - start );
+    increment( s );
+}
+
+int
+AdaptiveCode::get( RansDecoder& dec ) {
+    const uint64_t c =ransUnscale( dec.peek(), m_total );
+    // The largest symbol of which the cumulative weight does not exceed c
+    int s =0;
+    uint64_t low =0;
+    for( int step =m_highBit; step; step >>= 1 ) {
+        if( s + step < (int)m_tree.size() && low + m_tree[s + step] <= c ) {
+            s += step;
+            low += m_tree[s];
+        }
+    }
+    const uint32_t start =ransScale( low, m_total );
+    dec.advance( start, ransScale( prefix( s + 1 ), m_total ) - start );
+    increment( s );
+    return s;
+}
+
+/** Sum of the weights of the symbols below @s */
+uint64_t
+AdaptiveCode::prefix( int s ) const {
+    uint64_t sum =0;
+    for( ; s > 0; s -= s & -s ) sum += m_tree[s];
+    return sum;
+}
+
+void
+AdaptiveCode::increment( int s ) {
+    m_total += s_weightStep;
+    for( s++; s < (int)m_tree.size(); s += s & -s ) m_tree[s] += s_weightStep;
+}
+
+/* class CodecWriter implementation */
+
+bool
+CodecWriter::write( const Encoder& e, std::ostream& os ) {
+    const Matrix2D* mat =e.matrix();
+    const InstanceVector& instances =e.instanceVector();
+    if( !mat || !e.codeTable() ) return false;
+    const std::size_t width =mat->width(), count =mat->count();
+
+    const Pattern* background =nullptr;
+    for( auto&& p : *e.codeTable() ) {
+        if( p->isTabu() && p->size() == 1 ) {
+            background =p;
+            break;
+        }
+    }
+
+    // The patterns that are used get a code in the order of their labels
+    std::vector<const Pattern*> byLabel;
+    for( InstanceVector::IndexT i =0; i < instances.size(); i++ ) {
+        const Pattern* p =instances.pattern( i );
+        if( !p ) continue;
+        if( instances.variant( i )->isValid() ) {
+            fprintf( stderr, "CodecWriter: instances with a variant cannot be written.\n" );
+            return false;
+        }
+        if( p->label() >= byLabel.size() ) byLabel.resize( p->label() + 1, nullptr );
+        byLabel[p->label()] =p;
+    }
+    std::vector<const Pattern*> patterns;
+    std::vector<int> codes( byLabel.size(), -1 );
+    for( auto p : byLabel ) {
+        if( !p ) continue;
+        codes[p->label()] =patterns.size();
+        patterns.push_back( p );
+    }
+    const int symbols =patterns.size() + (background ? 1 : 0);
+    if( (uint64_t)symbols + (uint64_t)s_weightStep * count > RANS_SCALE ) {
+        fprintf( stderr, "CodecWriter: the matrix is too large.\n" );
+        return false;
+    }
+
+    // The elements of each pattern in row-major order, which starts with the element that is coded first
+    std::vector<std::vector<Pattern::ElementT>> layouts( patterns.size() );
+    for( int k =0; k < patterns.size(); k++ ) {
+        layouts[k].assign( patterns[k]->elements().begin(), patterns[k]->elements().end() );
+        std::sort( layouts[k].begin(), layouts[k].end(),
+                []( const Pattern::ElementT& a, const Pattern::ElementT& b ) { return a.offset < b.offset; } );
+    }
+
+    std::vector<Matrix2D::ElementT> alphabet;
+    for( auto&& layout : layouts )
+        for( auto&& elem : layout ) alphabet.push_back( elem.value );
+    if( background ) alphabet.push_back( background->elements().front().value );
+    std::sort( alphabet.begin(), alphabet.end() );
+    alphabet.erase( std::unique( alphabet.begin(), alphabet.end() ), alphabet.end() );
+    auto valueIndex =[&alphabet]( Matrix2D::ElementT v ) {
+        return (uint32_t)(std::lower_bound( alphabet.begin(), alphabet.end(), v ) - alphabet.begin() ); };
+
+    RansEncoder enc;
+
+    /* The model: alphabet, background and the patterns, followed by the corrections */
+    enc.putUInt( alphabet.size() );
+    for( int i =0; i < alphabet.size(); i++ )
+        enc.putUInt( i ? alphabet[i] - alphabet[i-1] - 1 : alphabet[i] );
+    enc.putUniform( background ? 1 : 0, 2 );
+    if( background ) enc.putUniform( valueIndex( background->elements().front().value ), alphabet.size() );
+
+    enc.putUInt( patterns.size() );
+    for( auto&& layout : layouts ) {
+        const Pattern::OffsetT first =layout.front().offset;
+        int colMin =first.col(), colMax =first.col();
+        for( auto&& elem : layout ) {
+            colMin =std::min( colMin, elem.offset.col() );
+            colMax =std::max( colMax, elem.offset.col() );
+        }
+        const uint32_t w =colMax - colMin + 1, h =layout.back().offset.row() - first.row() + 1;
+        enc.putUInt( layout.size() - 1 );
+        enc.putUInt( h - 1 );
+        enc.putUInt( w - 1 );
+        // The positions in the bounding box are increasing
+        uint32_t prev =first.col() - colMin;
+        enc.putUniform( prev, w );
+        for( int i =1; i < layout.size(); i++ ) {
+            const uint32_t k =(layout[i].offset.row() - first.row()) * w + (layout[i].offset.col() - colMin);
+            enc.putUInt( k - prev - 1 );
+            prev =k;
+        }
+        for( auto&& elem : layout )
+            enc.putUniform( valueIndex( elem.value ), alphabet.size() );
+    }
+
+    enc.putUInt( e.errorMap().size() );
+    for( auto&& error : e.errorMap() ) {
+        enc.putUniform( error.first.row(), mat->height() );
+        enc.putUniform( error.first.col(), mat->width() );
+        enc.putUInt( error.second );
+    }
+    m_modelBits =enc.bits();
+
+    /* The instances, in the order of their first element */
+    std::vector<int> anchors( count, -1 );
+    for( InstanceVector::IndexT i =0; i < instances.size(); i++ ) {
+        const Pattern* p =instances.pattern( i );
+        if( !p ) continue;
+        const int k =codes[p->label()];
+        const Coord2D c =layouts[k].front().offset.abs( instances.pivot( i ) );
+        if( !mat->checkBounds( c ) || anchors[c.position( width )] != -1 ) {
+            fprintf( stderr, "CodecWriter: two instances start at the same element.\n" );
+            return false;
+        }
+        anchors[c.position( width )] =k;
+    }
+
+    AdaptiveCode code( symbols );
+    std::vector<bool> covered( count, false );
+    for( std::size_t pos =0; pos < count; pos++ ) {
+        const int k =anchors[pos];
+        if( k == -1 ) {
+            if( covered[pos] ) continue;
+            if( !background ) {
+                fprintf( stderr, "CodecWriter: element %lu is not covered and there is no background.\n", (unsigned long)pos );
+                return false;
+            }
+            code.put( enc, patterns.size() );
+            covered[pos] =true;
+            continue;
+        }
+
+        const Coord2D anchor( pos / width, pos % width );
+        const Pattern::OffsetT first =layouts[k].front().offset;
+        for( auto&& elem : layouts[k] ) {
+            const Coord2D c( anchor.row() + elem.offset.row() - first.row(), anchor.col() + elem.offset.col() - first.col() );
+            if( !mat->checkBounds( c ) || covered[c.position( width )] ) {
+                fprintf( stderr, "CodecWriter: instances overlap or exceed the matrix at element %lu.\n", (unsigned long)pos );
+                return false;
+            }
+            covered[c.position( width )] =true;
+        }
+        code.put( enc, k );
+    }
+    m_dataBits =enc.bits() - m_modelBits;
+
+    std::ostringstream payload;
+    enc.flush( payload );
+    const std::string bytes =payload.str();
+
+    os.write( "VOUW", 4 );
+    writeInt( os, VOUW_CONTAINER_VERSION, 2 );
+    writeInt( os, 0, 2 );
+    writeInt( os, mat->width(), 4 );
+    writeInt( os, mat->height(), 4 );
+    writeInt( os, mat->base(), 4 );
+    writeInt( os, bytes.size(), 8 );
+    os.write( bytes.data(), bytes.size() );
+
+    m_bytes =VOUW_CONTAINER_HEADER_SIZE + bytes.size();
+    return (bool)os;
+}
+
+/* class CodecReader implementation */
+
+CodecReader::CodecReader( std::istream& is ) :
+    m_is( is ), m_width( 0 ), m_height( 0 ), m_base( 0 ), m_valid( false ),
+    m_hasBackground( false ), m_background( 0 ), m_nextCorrection( 0 ), m_pos( 0 ), m_nextRow( 0 ) {
+
+    unsigned char header[VOUW_CONTAINER_HEADER_SIZE];
+    m_is.read( (char*)header, VOUW_CONTAINER_HEADER_SIZE );
+    if( m_is.gcount() != VOUW_CONTAINER_HEADER_SIZE || memcmp( header, "VOUW", 4 ) ) {
+        fprintf( stderr, "CodecReader: not a VOUW container.\n" );
+        return;
+    }
+    if( readInt( header + 4, 2 ) != VOUW_CONTAINER_VERSION ) {
+        fprintf( stderr, "CodecReader: unsupported version %d.\n", (int)readInt( header + 4, 2 ) );
+        return;
+    }
+    m_width =readInt( header + 8, 4 );
+    m_height =readInt( header + 12, 4 );
+    m_base =readInt( header + 16, 4 );
+    if( m_width == 0 || m_height == 0 || (uint64_t)m_width * m_height > VOUW_CONTAINER_MAX_ELEMENTS ) {
+        fprintf( stderr, "CodecReader: invalid dimensions %ux%u.\n", m_width, m_height );
+        return;
+    }
+    m_rans.reset( new RansDecoder( m_is, readInt( header + 20, 8 ) ) );
+
+    m_valid =readModel();
+    if( !m_valid ) {
+        fprintf( stderr, "CodecReader: the code table is corrupt.\n" );
+        return;
+    }
+    m_values.resize( (std::size_t)m_width * m_height );
+    m_covered.assign( m_values.size(), false );
+}
+
+bool
+CodecReader::readRow( Matrix2D::ElementT* dst ) {
+    if( !m_valid || m_nextRow >= m_height ) return false;
+
+    const std::size_t begin =(std::size_t)m_nextRow * m_width, end =begin + m_width;
+    if( !decodeUntil( end ) ) {
+        m_valid =false;
+        fprintf( stderr, "CodecReader: the instances are corrupt in row %u.\n", m_nextRow );
+        return false;
+    }
+    std::copy( m_values.begin() + begin, m_values.begin() + end, dst );
+    for( ; m_nextCorrection < m_corrections.size() && m_corrections[m_nextCorrection].first < end; m_nextCorrection++ )
+        dst[m_corrections[m_nextCorrection].first - begin] =m_corrections[m_nextCorrection].second;
+    m_nextRow++;
+    return true;
+}
+
+Matrix2D*
+CodecReader::readMatrix() {
+    if( !m_valid ) return nullptr;
+    Matrix2D* mat =new Matrix2D( m_width, m_height, m_base );
+    std::vector<Matrix2D::ElementT> row( m_width );
+    while( m_nextRow < m_height ) {
+        const unsigned int i =m_nextRow;
+        if( !readRow( row.data() ) ) {
+            delete mat;
+            return nullptr;
+        }
+        mat->writeRow( i, row.data() );
+    }
+    return mat;
+}
+
+/* Private functions */
+
+bool
+CodecReader::readModel() {
+    RansDecoder& dec =*m_rans;
+    const uint64_t count =(uint64_t)m_width * m_height;
+
+    const uint32_t alphabetSize =dec.getUInt();
+    if( !dec.isValid() || alphabetSize > count + 1 ) return false;
+    // The tables grow as they are read, such that a corrupt size cannot allocate more than the input holds
+    std::vector<Matrix2D::ElementT> alphabet;
+    for( uint32_t i =0; i < alphabetSize && dec.isValid(); i++ )
+        alphabet.push_back( i ? alphabet[i-1] + dec.getUInt() + 1 : dec.getUInt() );
+    if( !dec.isValid() ) return false;
+
+    m_hasBackground =dec.getUniform( 2 );
+    if( m_hasBackground ) {
+        if( !alphabetSize ) return false;
+        m_background =alphabet[dec.getUniform( alphabetSize )];
+    }
+
+    const uint32_t patterns =dec.getUInt();
+    if( !dec.isValid() || patterns > count || (patterns && !alphabetSize) ) return false;
+    for( uint32_t j =0; j < patterns; j++ ) {
+        m_patterns.emplace_back();
+        PatternT& p =m_patterns.back();
+        // In 64 bits, such that none of them wraps to zero
+        const uint64_t size =(uint64_t)dec.getUInt() + 1;
+        const uint64_t h =(uint64_t)dec.getUInt() + 1, w =(uint64_t)dec.getUInt() + 1;
+        if( !dec.isValid() || size > count || h > m_height || w > m_width ) return false;
+
+        uint64_t k =dec.getUniform( w );
+        const int firstCol =k;
+        p.rows.push_back( 0 );
+        p.cols.push_back( 0 );
+        for( uint64_t i =1; i < size; i++ ) {
+            k += (uint64_t)dec.getUInt() + 1;
+            if( k >= w * h ) return false;
+            p.rows.push_back( k / w );
+            p.cols.push_back( (int)(k % w) - firstCol );
+        }
+        for( uint64_t i =0; i < size; i++ )
+            p.values.push_back( alphabet[dec.getUniform( alphabetSize )] );
+        if( !dec.isValid() ) return false;
+    }
+
+    const uint32_t errors =dec.getUInt();
+    if( errors > count ) return false;
+    for( uint32_t i =0; i < errors && dec.isValid(); i++ ) {
+        const std::size_t row =dec.getUniform( m_height ), col =dec.getUniform( m_width );
+        m_corrections.emplace_back( row * m_width + col, dec.getUInt() );
+    }
+    std::sort( m_corrections.begin(), m_corrections.end() );
+
+    m_code =AdaptiveCode( m_patterns.size() + (m_hasBackground ? 1 : 0) );
+    return dec.isValid();
+}
+
+/** Decodes the instances until the elements before @pos are known */
+bool
+CodecReader::decodeUntil( std::size_t pos ) {
+    RansDecoder& dec =*m_rans;
+    for( ; m_pos < pos; m_pos++ ) {
+        if( m_covered[m_pos] ) continue;
+        if( m_patterns.empty() && !m_hasBackground ) return false;
+
+        const int k =m_code.get( dec );
+        if( !dec.isValid() ) return false;
+        if( k == m_patterns.size() ) {
+            m_values[m_pos] =m_background;
+            m_covered[m_pos] =true;
+            continue;
+        }
+
+        const PatternT& p =m_patterns[k];
+        const int row =m_pos / m_width, col =m_pos % m_width;
+        for( int i =0; i < p.values.size(); i++ ) {
+            const int r =row + p.rows[i], c =col + p.cols[i];
+            if( r >= (int)m_height || c < 0 || c >= (int)m_width ) return false;
+            const std::size_t j =(std::size_t)r * m_width + c;
+            if( m_covered[j] ) return false;
+            m_values[j] =p.values[i];
+            m_covered[j] =true;
+        }
+    }
+    return true;
+}
+
+VOUW_NAMESPACE_END
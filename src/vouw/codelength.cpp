@@ -0,0 +1,106 @@
+/*
+ * VOUW - Spatial, compression-based pattern mining on matrices
+ *
+ * Micky Faas <micky@edukitty.org>
+ * (C) 2018, Leiden Institute for Advanced Computer Science
+ */
+
+#include <vouw/codelength.h>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+VOUW_NAMESPACE_BEGIN
+
+/* The 2 logarithm of c = 2.865064 */
+#define LOG2C 1.5185673663648485
+
+/* Upper limit to the size of the tables, 32MB each */
+#define CODELENGTH_TABLE_MAX (1U << 22)
+
+typedef std::vector<double> TableT;
+
+/* A table is never modified once it is published. A larger copy replaces it, 
+ * while the replaced tables are kept because other threads may still read them.
+ * As the tables at least double in size, the replaced ones take less memory than the current one. */
+static std::mutex s_mutex;
+static std::vector<std::unique_ptr<const TableT>> s_tables;
+
+/* With a pseudo count of one half, all arguments to lgamma() are multiples of one half.
+ * s_log2Gamma[k] holds lgamma( k/2 ) / log(2) */
+static std::atomic<const TableT*> s_log2Gamma( nullptr );
+static std::atomic<const TableT*> s_uintCodeLength( nullptr );
+
+/** This funcion computes log2*(n) + log2(c)
+  * log2*(n) is defined as log2(n) + log2(log2(n)) + ...
+  */
+static double
+uintCodeLengthExact( std::size_t n ) {
+    double l =LOG2C; // Code lengt in bits
+    double logn =log2( n );
+
+    // Only add the result if non-zero and positive
+    // This is guaranteed to halt as log2(log2(... will eventually become negative
+    while( logn > 0.0 ) {
+        l += logn;
+        logn = log2( logn );
+    };
+
+    return l;
+}
+
+double
+uintCodeLength( unsigned int n ) {
+    const TableT* t =s_uintCodeLength.load( std::memory_order_acquire );
+    if( t && n < t->size() )
+        return (*t)[n];
+    return uintCodeLengthExact( n );
+}
+
+double
+log2Gamma( unsigned int n, unsigned int m ) {
+    if( pseudoCount == .5 ) {
+        const std::size_t k =2 * (std::size_t)n + m;
+        const TableT* t =s_log2Gamma.load( std::memory_order_acquire );
+        if( t && k < t->size() )
+            return (*t)[k];
+    }
+    return lgamma( (double)n + pseudoCount * (double)m ) / log(2);
+}
+
+static double
+log2GammaHalf( std::size_t k ) {
+    // k/2 equals n + pseudoCount * m exactly, the argument to lgamma() is the same
+    return lgamma( .5 * (double)k ) / log(2);
+}
+
+/** Replaces @table by a copy that holds at least @n values, computed by @f. Requires s_mutex */
+static void
+growTable( std::atomic<const TableT*>& table, std::size_t n, double (*f)( std::size_t ) ) {
+    n =std::min<std::size_t>( n, CODELENGTH_TABLE_MAX );
+    const TableT* old =table.load( std::memory_order_relaxed );
+    const std::size_t size =old ? old->size() : 0;
+    if( n <= size ) return;
+    n =std::min<std::size_t>( std::max( n, 2 * size ), CODELENGTH_TABLE_MAX );
+
+    TableT* t =new TableT;
+    t->reserve( n );
+    if( old ) t->assign( old->begin(), old->end() );
+    for( std::size_t k =size; k < n; k++ )
+        t->push_back( f( k ) );
+
+    s_tables.emplace_back( t );
+    table.store( t, std::memory_order_release );
+}
+
+void
+reserveCodeLengths( unsigned int gammaSize, unsigned int uintSize ) {
+    std::lock_guard<std::mutex> lock( s_mutex );
+    growTable( s_log2Gamma, gammaSize, log2GammaHalf );
+    growTable( s_uintCodeLength, uintSize, uintCodeLengthExact );
+}
+
+VOUW_NAMESPACE_END
@@ -6,37 +6,72 @@
  */
 
 #include <vouw/codetable.h>
+#include <vouw/codelength.h>
 #include <vouw/pattern.h>
 #include <vouw/matrix.h>
 #include <vouw/massfunction.h>
 #include <cmath>
 #include <algorithm>
 
-using namespace std::placeholders;
-
 VOUW_NAMESPACE_BEGIN
 
 CodeTable::CodeTable( int matWidth, int matHeight, int matBase) : 
-    std::list<Pattern*>(), 
-    m_bits( 0.0 ) {
+    m_bits( 0.0 ), m_arena( new Arena() ), m_activeNonSingleton( 0 ),
+    m_entryBits( 0.0 ), m_codeBits( 0.0 ), m_contributingCount( 0 ) {
     setMatrixSize( matWidth, matHeight, matBase );
 }
 
 CodeTable::CodeTable( const Matrix2D* mat ) : 
-    std::list<Pattern*>(), 
-    m_bits( 0.0 ) {
+    m_bits( 0.0 ), m_arena( new Arena() ), m_activeNonSingleton( 0 ),
+    m_entryBits( 0.0 ), m_codeBits( 0.0 ), m_contributingCount( 0 ) {
     setMatrixSize( mat->width(), mat->height(), mat->base() );
 }
 
 CodeTable::~CodeTable() {
-    for( auto&& p : *this ) delete p;
+    for( auto&& p : m_pool ) delete p;
+    delete m_arena;
+}
+
+void
+CodeTable::add( Pattern* p ) {
+    p->setLabel( m_pool.size() );
+    m_pool.push_back( p );
+    p->moveToArena( m_arena );
+    m_activeIndex.push_back( -1 );
+    setActive( p, p->isActive() );
+}
+
+void
+CodeTable::setActive( Pattern* p, bool b ) {
+    const int label =p->label();
+    p->m_active =b;
+    if( (m_activeIndex[label] != -1) == b ) return;
+
+    if( b ) {
+        m_activeIndex[label] =m_active.size();
+        m_active.push_back( label );
+        if( p->size() > 1 ) m_activeNonSingleton++;
+    } else {
+        // Move the last active label into the vacated position
+        const int i =m_activeIndex[label];
+        const int last =m_active.back();
+        m_active[i] =last;
+        m_activeIndex[last] =i;
+        m_active.pop_back();
+        m_activeIndex[label] =-1;
+        if( p->size() > 1 ) m_activeNonSingleton--;
+    }
 }
 
 int 
 CodeTable::countIfActiveGTE( int minSize ) const 
 { 
-    auto f = std::bind( pattern_is_active_gte, _1, minSize ); 
-    return std::count_if( begin(), end(), f ); 
+    if( minSize <= 1 ) return countIfActive();
+    if( minSize == 2 ) return countIfActiveNonSingleton();
+    int n =0;
+    for( auto label : m_active )
+        if( m_pool[label]->size() >= minSize ) n++;
+    return n; 
 }
 
 void CodeTable::updateCodeLengths( int totalInstances, const MassFunction& distr ) {
@@ -49,10 +84,14 @@ void CodeTable::updateCodeLengths( int totalInstances, const MassFunction& distr
                      + log2( m_width * m_height )
                      ;*///+ uintCodeLength( binom( m_width * m_height, totalInstances ) );
 
-    double inst_bits = lgamma( (double)totalInstances + pseudoCount * (double)ctSize ) / log(2)
-               - lgamma( pseudoCount * (double)ctSize ) / log(2); 
+    double inst_bits = log2Gamma( totalInstances, ctSize )
+               - log2Gamma( 0, ctSize ); 
+
+    m_entryBits =m_codeBits =0.0;
+    m_contributingCount =0;
+    m_contributions.clear();
 
-    for( auto p : *this ) {
+    for( auto p : m_pool ) {
         if( p->isActive() ) {
             inst_bits += p->updateCodeLength( totalInstances, ctSize );
             if( p->entryLength() != 0.0 )
@@ -62,6 +101,9 @@ void CodeTable::updateCodeLengths( int totalInstances, const MassFunction& distr
         } else
             p->updateCodeLength( totalInstances, ctSize );
         //m_bits += p->size() * m_stdBitsPerOffset;
+        
+        // Keep track of the contribution of p for incremental updates
+        updateContribution( p, totalInstances, ctSize, distr );
     }
 
     m_bits =ct_bits + inst_bits;// + totalInstances;
@@ -69,9 +111,95 @@ void CodeTable::updateCodeLengths( int totalInstances, const MassFunction& distr
 //    fprintf( stderr, "L(H) = %f, L(D|H) = %f\n", ct_bits, inst_bits );
 }
 
+void 
+CodeTable::updateCodeLengths( int totalInstances, const MassFunction& distr, const std::vector<Pattern*>& touched ) {
+    for( auto p : touched ) 
+        updateContribution( p, totalInstances, m_contributingCount, distr );
+
+    m_bits =totalLength( totalInstances, m_contributingCount );
+}
+
+/** Replaces the contribution of @p in the totals by its current one */
+double
+CodeTable::updateContribution( Pattern* p, int totalInstances, int ctSize, const MassFunction& distr ) {
+    if( p->label() >= m_contributions.size() ) 
+        m_contributions.resize( p->label()+1, ContributionT() );
+    ContributionT& c =m_contributions[p->label()];
+
+    if( c.active ) {
+        m_entryBits -= c.entryBits;
+        m_codeBits -= c.codeBits;
+        m_contributingCount--;
+    }
+
+    c.active =p->isActive();
+    c.codeBits =p->updateCodeLength( totalInstances, ctSize );
+    c.entryBits =0.0;
+    if( c.active ) {
+        c.entryBits =p->entryLength() != 0.0 ? p->entryLength() : p->updateEntryLength( distr, m_width, m_height );
+        m_entryBits += c.entryBits;
+        m_codeBits += c.codeBits;
+        m_contributingCount++;
+    }
+    return c.codeBits;
+}
+
+/** L(CT) + L(D|CT) from the sums over the active patterns. 
+ *  Only the model size and normalization are recomputed. */
+double
+CodeTable::totalLength( int totalInstances, int ctSize ) const {
+    double ct_bits =uintCodeLength( ctSize ) + m_entryBits;
+    double inst_bits =log2Gamma( totalInstances, ctSize ) - log2Gamma( 0, ctSize ) + m_codeBits;
+    return ct_bits + inst_bits;
+}
+
 void CodeTable::sortBySizeDesc() {
-    sort( [](Pattern* a, Pattern* b) {
-            return b->size() < a->size(); } );
+    // Ties are broken by label, which is the order of a stable sort on the order of creation
+    std::sort( m_active.begin(), m_active.end(), [this](int a, int b) {
+            const int sa =m_pool[a]->size(), sb =m_pool[b]->size();
+            return sb < sa || (sb == sa && a < b); } );
+    for( int i =0; i < m_active.size(); i++ )
+        m_activeIndex[m_active[i]] =i;
+}
+
+int
+CodeTable::reclaim() {
+    // Mark all patterns in the composition trees of the active patterns
+    std::vector<bool> reachable( m_pool.size(), false );
+    std::vector<const Pattern*> stack;
+    for( auto label : m_active ) stack.push_back( m_pool[label] );
+    while( !stack.empty() ) {
+        const Pattern* p =stack.back();
+        stack.pop_back();
+        if( reachable[p->label()] ) continue;
+        reachable[p->label()] =true;
+        if( p->composition().isValid() ) {
+            stack.push_back( p->composition().p1 );
+            stack.push_back( p->composition().p2 );
+        }
+    }
+
+    int released =0;
+    std::size_t used =0;
+    for( auto p : m_pool ) {
+        if( p->isReleased() ) continue;
+        if( reachable[p->label()] ) {
+            used += p->storageSize();
+        } else {
+            p->release();
+            released++;
+        }
+    }
+
+    // Move the remaining patterns to a new arena, such that the old one can be freed
+    if( used * 2 < m_arena->size() ) {
+        Arena* arena =new Arena();
+        for( auto p : m_pool ) 
+            if( !p->isReleased() ) p->moveToArena( arena );
+        delete m_arena;
+        m_arena =arena;
+    }
+    return released;
 }
 
 void 
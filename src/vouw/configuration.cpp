@@ -17,18 +17,46 @@ Configuration::Configuration( const Pattern& p  ) {
 void
 Configuration::setFromPattern( const Pattern& p ) {
     m_data.clear();
-    m_data.resize( p.bounds().width * p.bounds().height );
+    m_data.resize( (p.bounds().width * p.bounds().height + 63) / 64 );
     int w = m_width = p.bounds().width;
+    m_height =p.bounds().height;
     for( const auto & elem : p.elements() ) {
         int key = (elem.offset.row() - p.bounds().rowMin) * w 
             + (elem.offset.col() - p.bounds().colMin);
-        m_data[key] =true;
+        m_data[key / 64] |= 1ULL << (key % 64);
     }
+
+    // FNV-1a over the dimensions and the words
+    uint64_t h =0xcbf29ce484222325ULL;
+    auto mix = [&h]( uint64_t v ) { h =(h ^ v) * 0x100000001b3ULL; };
+    mix( (uint64_t)m_width << 32 | (uint32_t)m_height );
+    for( auto word : m_data ) mix( word );
+    m_fingerprint =h;
 }
 
 bool 
 Configuration::operator==( const Configuration& rhs ) const {
-    return m_width == rhs.m_width && m_data == rhs.m_data;
+    return m_fingerprint == rhs.m_fingerprint && m_width == rhs.m_width && m_height == rhs.m_height && m_data == rhs.m_data;
+}
+
+/* class ConfigurationRegistry implementation */
+
+ConfigIDT
+ConfigurationRegistry::id( const Configuration& c ) {
+    auto range =m_index.equal_range( c.fingerprint() );
+    for( auto it =range.first; it != range.second; it++ )
+        if( m_configs[it->second] == c ) return it->second;
+
+    const ConfigIDT id =m_configs.size();
+    m_configs.push_back( c );
+    m_index.insert( std::make_pair( c.fingerprint(), id ) );
+    return id;
+}
+
+void
+ConfigurationRegistry::clear() {
+    m_configs.clear();
+    m_index.clear();
 }
 
 VOUW_NAMESPACE_END
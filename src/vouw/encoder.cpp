@@ -9,6 +9,8 @@
 #include <vouw/matrix.h>
 #include <vouw/codetable.h>
 #include <vouw/equivalence.h>
+#include <vouw/codelength.h>
+#include <vouw/pattern_matcher.h>
 #include <map>
 #include <unordered_map>
 #include <bitset>
@@ -18,8 +20,11 @@
 #include <iostream>
 #include <iomanip>
 #include <cassert>
+#include <ctime>
 #include <limits>
 #include <set>
+#include <thread>
+#include <array>
 
 /* Chrono library used to measure execution time of various functions */
 #include <chrono>
@@ -30,6 +35,9 @@ typedef std::chrono::high_resolution_clock::time_point TimeVarT;
 #define timeNow() std::chrono::high_resolution_clock::now()
 /* End Chrono part */
 
+/* Fraction of cleared instances in the instance vector above which it is compacted */
+#define COMPACTION_RATIO .1
+
 VOUW_NAMESPACE_BEGIN
 
 int
@@ -47,18 +55,22 @@ Encoder::Encoder( EquivalenceSet* es ) :
         m_es( es ),
         m_mat(0),
         m_ct(0),
+        m_isFixedModel( false ),
         m_local( NoLocalSearch ),
-        m_heuristic( Best1 ) {
+        m_heuristic( Best1 ),
+        m_candidateSearch( FullSearch ),
+        m_candidateSelection( SortedSelection ),
+        m_threadCount( 1 ),
+        m_verifyCodeLengths( false ),
+        m_verifySelection( false ) {
     clear();
 }
 
-Encoder::Encoder( Matrix2D* mat, EquivalenceSet* es ) : m_es( es ), m_ct(0) {
-    clear();
+Encoder::Encoder( Matrix2D* mat, EquivalenceSet* es ) : Encoder( es ) {
     setFromMatrix( mat );
 }
 
-Encoder::Encoder( Matrix2D* mat, CodeTable* ct, EquivalenceSet* es ) : m_es( es ) {
-    clear();
+Encoder::Encoder( Matrix2D* mat, CodeTable* ct, EquivalenceSet* es ) : Encoder( es ) {
     setFromMatrixUsing( mat, ct );
 }
 
@@ -78,7 +90,7 @@ void Encoder::setFromMatrix( Matrix2D* mat, bool useTabu ) {
     m_ct = new CodeTable( mat );
     m_instvec.setMatrixSize( mat->width(), mat->height(), mat->base() );
     m_instvec.reserve( mat->width() * mat->height() );
-    m_instmat.setRowLength( mat->width() );
+    m_instmat.setSize( mat->width(), mat->height() );
     m_mat =mat;
     const MassFunction *massfunc = &mat->distribution();
     
@@ -87,7 +99,7 @@ void Encoder::setFromMatrix( Matrix2D* mat, bool useTabu ) {
     if( useTabu ) {
         /* If tabu is enabled, we first find the value with the highest frequency */
         MassFunction::CountT freq =0;
-        for( auto pair : massfunc->elements() ) {
+        for( auto pair : *massfunc ) {
             if( pair.second > freq ) {
                 freq =pair.second;
                 tabuElem =pair.first;
@@ -141,6 +153,7 @@ void Encoder::setFromMatrix( Matrix2D* mat, bool useTabu ) {
             else {
                 m_instvec.emplace_back( p, c, v );
                 m_instmat.place( m_instvec.size()-1, m_instvec.back() );
+                addPosting( p, m_instvec.size()-1 );
                 m_instanceCount++;
             }
 
@@ -149,12 +162,98 @@ void Encoder::setFromMatrix( Matrix2D* mat, bool useTabu ) {
     }
     std::cerr << "Added " << m_ct->countIfActive() << " patterns in " << totalCount() << " instances." << std::endl;
 
+    reserveCodeLengths( 2 * totalCount() + m_ct->size() + 2, m_ct->size() + 2 );
 
-    m_priorBits =updateCodeLengths();
+    m_priorBits =updateCodeLengths( true );
 }
 
+/** Encodes @mat using the fixed code table @ct, instead of searching for patterns. The active patterns of @ct 
+ *  cover the matrix greedily, largest first as in reencode(), and the remaining elements are encoded by singletons.
+ *  Values that have no singleton in @ct get one of their own. The encoder does not own nor modify @ct, 
+ *  such that one model can be shared by many encoders, also concurrently. The flags of @mat are not used. */
 void Encoder::setFromMatrixUsing( Matrix2D* mat, CodeTable* ct ) {
+    clear();
+    m_ct =ct;
+    m_isFixedModel =true;
+    m_instvec.setMatrixSize( mat->width(), mat->height(), mat->base() );
+    m_instvec.reserve( mat->width() * mat->height() );
+    m_instmat.setSize( mat->width(), mat->height() );
+    m_mat =mat;
+    m_fixedUsage.assign( ct->size(), 0 );
+
+    /* The patterns of the model by size, ties are broken by label as in CodeTable::sortBySizeDesc() */
+    std::vector<Pattern*> patterns;
+    std::unordered_map<Matrix2D::ElementT,Pattern*> singletons;
+    Pattern* tabu =nullptr;
+    for( auto&& p : *ct ) {
+        if( p->isReleased() ) continue;
+        if( p->isTabu() ) {
+            if( p->size() == 1 ) tabu =p;
+            continue;
+        }
+        if( p->size() == 1 ) {
+            auto it =singletons.find( p->elements().front().value );
+            if( it == singletons.end() || (!it->second->isActive() && p->isActive()) )
+                singletons[p->elements().front().value] =p;
+        }
+        if( p->isActive() ) patterns.push_back( p );
+    }
+    std::stable_sort( patterns.begin(), patterns.end(), []( const Pattern* a, const Pattern* b ) { return a->size() > b->size(); } );
+
+    PatternMatcher matcher( m_mat, m_threadCount );
+    for( auto&& p : patterns ) matcher.add( p );
+    matcher.run();
+
+    // The covered elements are kept in a bit-plane apart from the flags of the matrix, which is left untouched
+    const int width =m_mat->width();
+    std::vector<uint64_t> covered( (m_mat->count() + 63) / 64, 0 );
+    for( int k =0; k < patterns.size(); k++ ) {
+        Pattern* p =patterns[k];
+        const Pattern::MaskT& mask =matcher.mask( k );
+        for( auto&& c : matcher.matches( k ) ) {
+            if( !mask.isClear( covered, width, p->origin( c ) ) ) continue;
+
+            mask.set( covered, width, p->origin( c ) );
+            m_fixedUsage[p->label()]++;
+            m_instvec.emplace_back( p, c, m_es->makeNullVariant() );
+        }
+    }
 
+    /* The elements that are left are either background or singletons */
+    for( int i =0; i < m_mat->height(); i++ ) {
+        for( int j =0; j < width; j++ ) {
+            Coord2D c =m_mat->makeCoord( i, j );
+            const std::size_t pos =c.position( width );
+            if( (covered[pos >> 6] >> (pos & 63)) & 1 ) continue;
+            const Matrix2D::ElementT elem =m_mat->value( c );
+            if( tabu && elem == tabu->elements().front().value ) {
+                m_fixedUsage[tabu->label()]++;
+                m_tabuCount++;
+                continue;
+            }
+            Pattern*& p =singletons[elem];
+            if( !p ) {
+                p =new Pattern( elem, m_mat->width() );
+                p->setLabel( m_fixedUsage.size() );
+                m_fixedUsage.push_back( 0 );
+                m_escapes.push_back( p );
+            }
+            m_fixedUsage[p->label()]++;
+            m_instvec.emplace_back( p, c, m_es->makeNullVariant() );
+        }
+    }
+
+    m_instvec.sortByPivot();
+    for( int i =0; i < m_instvec.size(); i++ )
+        m_instmat.place( i, m_instvec[i] );
+    m_instanceCount =m_instvec.size();
+
+    m_priorBits =singletonLength( m_mat->distribution(), m_mat->width(), m_mat->height() );
+    m_encodedBits =fixedModelLength();
+    m_isEncoded =true;
+
+    std::cerr << "Covered by " << patterns.size() << " patterns and " << m_escapes.size() << " new singletons in "
+              << totalCount() << " instances." << std::endl;
 }
 
 void Encoder::setEquivalenceSet( EquivalenceSet* es ) {
@@ -164,33 +263,54 @@ void Encoder::setEquivalenceSet( EquivalenceSet* es ) {
 
 void Encoder::clear() {
     m_mat =nullptr;
-    if( m_ct ) {
+    if( m_ct && !m_isFixedModel )
         delete m_ct;
-        m_ct =nullptr;
-    }
+    m_ct =nullptr;
+    m_isFixedModel =false;
+    for( auto p : m_escapes ) delete p;
+    m_escapes.clear();
+    m_fixedUsage.clear();
     m_instvec.clear();
     m_instmat.clear();
     m_smap.clear();
-    m_configvec.clear();
+    m_configs.clear();
+    m_patternIndex.clear();
     m_errormap.clear();
+    m_candidates.clear();
+    m_instanceCandidates.clear();
+    m_changedInstances.clear();
+    m_postings.clear();
+    m_touchedPatterns.clear();
+    m_markerStamp =(1UL << 31) | 1;
+    m_dirtyMarker.clear();
+    m_dirtyStamp =0;
+    m_candidatesValid =false;
 
     m_tabuCount =0;
     m_instanceCount =0;
 
     m_priorBits =0.0;
+    m_dataBits =0.0;
     m_isEncoded =false;
-    m_lastLabel =0;
     m_decompositions =0;
     m_iteration =0;
 }
 
 bool Encoder::encodeStep() { 
+    // The code table of a fixed model is read-only
+    if( m_isFixedModel ) return false;
     m_iteration ++;
     fprintf( stderr, "\n *** Iteration %d, finding candidates ... ", m_iteration );
 
     TimeVarT t1 = timeNow();
 
-    rebuildCandidateMap();
+    if( m_candidateSearch == IncrementalSearch && m_candidatesValid )
+        updateCandidateMap();
+    else
+        rebuildCandidateMap();
+
+    // The contributions of the cleared instances have been retracted, they can be removed
+    compactInstances();
 
     TimeVarT t2 = timeNow();
     std::cerr << "Elapsed time: " << duration( t2-t1 ) << " ms."<< std::endl;
@@ -198,22 +318,26 @@ bool Encoder::encodeStep() {
 
     // We keep track of the modelsize during each iteration, because it is expensive to recompute
     int modelSize = m_ct->countIfActive();
+    // Make sure the code lengths are cached before the gains are computed, possibly by multiple threads
+    reserveCodeLengths( 2 * totalCount() + modelSize + 2, modelSize + 2 );
 
     // We estimate the gain for each candidate
     CandidateGainVectorT gainvec;
-    for( auto&& pair : m_candidates ) {
-        if( pair.second <= 1 ) continue;
-        const Candidate& c = pair.first;
-
-        double gain = computeGain( &c, pair.second, modelSize );
-        if( gain > 0.0 || m_iteration == 1) {
-            gainvec.push_back( CandidateGainT( c, gain ) );
+    LazySelectionT lazy;
+    const bool isLazy =m_candidateSelection == LazySelection;
+    if( isLazy ) {
+        initLazySelection( lazy, modelSize );
+        std::cerr << "Bounded the gain of " << lazy.keys.size() << " candidates in " << lazy.buckets.size() << " groups." << std::endl;
+    } else {
+        if( m_threadCount > 1 && m_candidates.size() > 4096 ) {
+            computeGainParallel( gainvec, modelSize );
+        } else {
+            computeGainShard( 0, m_candidates.capacity(), modelSize, &gainvec );
+            std::sort( gainvec.begin(), gainvec.end(), cg_gain_gt );
         }
-    }
 
-    std::cerr << "Retained " << gainvec.size() << " candidates with positive gain." << std::endl;
-
-    std::sort( gainvec.begin(), gainvec.end(), cg_gain_gt );
+        std::cerr << "Retained " << gainvec.size() << " candidates with positive gain." << std::endl;
+    }
   
    /* int bestUsage =0;
     double bestGain =-std::numeric_limits<double>::infinity();
@@ -230,30 +354,23 @@ bool Encoder::encodeStep() {
     //printf( "Estimated gain %f, estimated usage: %d\n", bestGain, bestUsage );
 
 
-    double totalGain =0.0; int totalMerge =0;
-    const int maxMerge = m_heuristic == Best1 ? 1 : gainvec.size();
-    std::vector<Pattern*> usedps; // We need indepedent candidates, i.e. disjunct sets of patterns
-
-    for( auto&& cg : gainvec ) {
-
-        if( std::find( usedps.begin(), usedps.end(), cg.first.p1 ) == usedps.end() &&
-            std::find( usedps.begin(), usedps.end(), cg.first.p2 ) == usedps.end() ) {
-           
-            if( m_iteration == 1 && totalMerge > 0 && cg.second < 0 ) break;
-
-            bool ff =false; // Flood fill
-            totalGain += processCandidate( cg, ff, modelSize );
+    // The candidates are chosen before any of them is merged, such that all gains are those of the current model
+    CandidateGainVectorT chosen;
+    selectCandidates( gainvec, isLazy ? &lazy : nullptr, chosen );
+    if( isLazy ) {
+        std::cerr << "Evaluated the gain of " << lazy.evaluated << " candidates. ";
+        if( m_verifySelection ) checkSelection( chosen, modelSize );
+    }
 
-            if( ff ) break;
+    double totalGain =0.0; int totalMerge =0;
+    for( auto&& cg : chosen ) {
+        bool ff =false; // Flood fill
+        totalGain += processCandidate( cg, ff, modelSize );
 
-            usedps.push_back( cg.first.p1 );
-            usedps.push_back( cg.first.p2 );
-            if( ++totalMerge == maxMerge )
-                break;
-        }
+        if( ff ) break;
+        totalMerge++;
     }
 
-
     TimeVarT t4 = timeNow();
     std::cerr << "Merged " << totalMerge << " patterns. Elapsed time: " << duration( t4-t3 ) << " ms."<< std::endl;
 
@@ -283,12 +400,12 @@ bool Encoder::encodeStep() {
              prune = prunePattern( p, false ) || prune;
         }
         if( prune ) { 
-            std::sort( m_instvec.begin(), m_instvec.end() );
+            m_instvec.sortByPivot();
             return true;
         }*/
 
         m_isEncoded =true;
-        rebuildInstanceMatrix();
+        compactInstances( true );
 
       /*  for( auto&& p : *m_ct ) {
             if( p->isActive() )
@@ -307,8 +424,11 @@ bool Encoder::encodeStep() {
         prunePattern( bestC.p2, false );*/
 
     if( m_iteration % 1000 == 0 ) {
-        std::cerr << "Rebuilding instance matrix..." << std::endl;
-        rebuildInstanceMatrix();
+        // Free the patterns that can no longer be used
+        const int released =m_ct->reclaim();
+        std::cerr << "Released " << released << " patterns." << std::endl;
+        // Clear the rounding errors accumulated by the incremental updates
+        updateCodeLengths( true );
     }
     
     TimeVarT t5 = timeNow();
@@ -338,52 +458,147 @@ Encoder::encode() {
 
 void
 Encoder::reencode() {
+    if( m_isFixedModel ) return;
 
     m_instvec.clear();
     m_instmat.clear();
+    for( auto&& list : m_postings ) list.clear();
 
     /* Iterate over all patterns in the CT, sorted descending by size */
     m_ct->sortBySizeDesc();
-    for( Pattern* p : *m_ct ) {
+    // The active set changes while we iterate it
+    const std::vector<int> labels =m_ct->activeLabels();
 
-        if( !p->isActive() ) continue;
+    /* The positions at which the patterns fit the values do not depend on the order,
+     * these are found up-front for all patterns at once */
+    TimeVarT t1 = timeNow();
+    PatternMatcher matcher( m_mat, m_threadCount );
+    std::vector<Pattern*> patterns;
+    for( int label : labels ) {
+        Pattern* p =m_ct->pattern( label );
         if( p->isTabu() ) continue;
-        p->setActive( false );
-        p->usage() =0;
+        matcher.add( p );
+        patterns.push_back( p );
+    }
+    matcher.run();
+    TimeVarT t2 = timeNow();
 
-        for( int i =-p->bounds().rowMin; i < m_mat->height() - p->bounds().rowMax; i++ ) {
-            for( int j =-p->bounds().colMin; j < m_mat->width() - p->bounds().colMax; j++ ) {
-                Coord2D c =m_mat->makeCoord( i, j );
+    /* Greedy cover, largest pattern first: a match is only used if none of its elements is covered yet */
+    for( int k =0; k < patterns.size(); k++ ) {
+        Pattern* p =patterns[k];
+        m_ct->setActive( p, false );
+        p->usage() =0;
 
-                /* Test if p fits the matrix at pivot c */
-                if( p->test( m_mat, c, true, false, true ) ) {
-                    p->apply( m_mat, c, true, true, false );
+        for( auto&& c : matcher.matches( k ) ) {
+            if( p->test( m_mat, c, false, false, true ) ) {
+                p->apply( m_mat, c, true, true, false );
 
-                    p->usage()++;
-                    p->setActive( true );
-                    m_instvec.emplace_back( p, c, m_es->makeNullVariant() );
-                }
+                p->usage()++;
+                m_ct->setActive( p, true );
+                m_instvec.emplace_back( p, c, m_es->makeNullVariant() );
             }
         }
     }
+    fprintf( stderr, "Reencoded using %d patterns: matched in %ld ms (%lu collisions), covered in %ld ms.\n",
+            (int)patterns.size(), (long)duration( t2-t1 ), (unsigned long)matcher.collisions(), (long)duration( timeNow()-t2 ) );
     rebuildInstanceMatrix( true );
+    invalidateCandidateMap();
 
     m_mat->unflagAll();
-    updateCodeLengths();
+    updateCodeLengths( true );
 }
 
+/** Reconstructs the matrix from the instances and the code table; the caller owns the result.
+ *  The elements that are not covered by an instance take the value of the tabu singleton, 
+ *  the errors of noisy merges are corrected afterwards. */
 Matrix2D* 
 Encoder::decode() {
+    if( !m_mat || !m_ct ) return nullptr;
+    const int width =m_mat->width(), height =m_mat->height();
 
+    Matrix2D::ElementT background =0;
+    for( auto&& p : *m_ct ) {
+        if( p->isTabu() && p->size() == 1 ) {
+            background =p->elements().front().value;
+            break;
+        }
+    }
+
+    // The layouts of the patterns that are used, by label
+    std::vector<DecodeLayoutT> layouts( m_ct->size() + m_escapes.size() );
+    for( InstanceVector::IndexT i =0; i < m_instvec.size(); i++ ) {
+        const Pattern* p =m_instvec.pattern( i );
+        if( !p || !layouts[p->label()].values.empty() ) continue;
+
+        DecodeLayoutT& layout =layouts[p->label()];
+        for( auto&& elem : p->elements() ) {
+            const int row =elem.offset.row(), col =elem.offset.col();
+            if( !layout.runs.empty() && layout.runs.back().row == row 
+                    && layout.runs.back().col + layout.runs.back().length == col )
+                layout.runs.back().length++;
+            else
+                layout.runs.push_back( DecodeLayoutT::RunT{ row, col, 1, (int)layout.values.size() } );
+            layout.values.push_back( elem.value );
+        }
+    }
+
+    // Instances do not overlap, yet every band of rows is stamped by a single thread only
+    std::vector<Matrix2D::ElementT> values( (std::size_t)width * height, background );
+    const int bands =std::max( 1, std::min( m_threadCount, height / 16 ) );
+    std::vector<std::thread> threads;
+    for( int b =0; b < bands; b++ )
+        threads.emplace_back( &Encoder::decodeBand, this, height * b / bands, height * (b+1) / bands, 
+                std::cref( layouts ), values.data() );
+    for( auto&& t : threads ) t.join();
+
+    // The variants of the default equivalence set do not change the pattern, others are applied to a copy
+    for( InstanceVector::IndexT i =0; i < m_instvec.size(); i++ ) {
+        if( m_instvec.isEmpty( i ) || !m_instvec.variant( i )->isValid() ) continue;
+        Pattern p( *m_instvec.pattern( i ) );
+        m_instvec.variant( i )->apply( p );
+        for( auto&& elem : p.elements() )
+            values[elem.offset.abs( m_instvec.pivot( i ) ).position( width )] =elem.value;
+    }
+
+    for( auto&& error : m_errormap )
+        values[error.first.position( width )] =error.second;
+
+    Matrix2D* mat =new Matrix2D( width, height, m_mat->base() );
+    for( int i =0; i < height; i++ )
+        mat->writeRow( i, &values[(std::size_t)i * width] );
+    return mat;
 }
 
 /* Private functions for class Encoder */
 
+/** Stamps the runs of all instances with the null variant into the rows [@rowBegin,@rowEnd) of @values.
+ *  Only reads the instances and may run concurrently for disjoint bands */
+void
+Encoder::decodeBand( int rowBegin, int rowEnd, const std::vector<DecodeLayoutT>& layouts, Matrix2D::ElementT* values ) const {
+    const std::size_t width =m_mat->width();
+    for( InstanceVector::IndexT i =0; i < m_instvec.size(); i++ ) {
+        const Pattern* p =m_instvec.pattern( i );
+        if( !p || m_instvec.variant( i )->isValid() ) continue;
+        const Coord2D pivot =m_instvec.pivot( i );
+        if( pivot.row() + p->bounds().rowMax < rowBegin || pivot.row() + p->bounds().rowMin >= rowEnd ) continue;
+
+        const DecodeLayoutT& layout =layouts[p->label()];
+        for( auto&& run : layout.runs ) {
+            const int row =pivot.row() + run.row;
+            if( row < rowBegin || row >= rowEnd ) continue;
+            std::copy( &layout.values[run.first], &layout.values[run.first] + run.length, 
+                    values + row * width + pivot.col() + run.col );
+        }
+    }
+}
+
 void
 Encoder::rebuildCandidateMap() {
     int progress =0, total = totalCount();
+    const bool record = m_candidateSearch == IncrementalSearch;
 
-    m_candidates.clear();
+    // The number of candidates changes little between iterations
+    m_candidates.reset( m_candidates.size() );
     m_overlapMask.resize( m_instvec.size() );
     //m_overlapMask.assign( m_instvec.size(), Instance::BitmaskT() );
     for( auto && mask : m_overlapMask ) {
@@ -393,75 +608,772 @@ Encoder::rebuildCandidateMap() {
         m_instanceMarker.resize( m_instvec.size() );
         m_instanceMarker.assign( m_instvec.size(), 1UL << 31 );
     }
+    if( record ) {
+        m_instanceCandidates.clear();
+        m_instanceCandidates.resize( m_instvec.size() );
+    }
 
     InstanceVector::IndexT odd =0;
     if( m_iteration % 2 != 0 )
         odd = 1UL << 30;
 
-    for( int i =0; i < m_instvec.size(); i++ ) {
-        Instance &r1 = m_instvec[i];
-        if( r1.empty() ) continue;
+    // The incremental map is updated in the order of the instances, by a single thread
+    if( record && m_threadCount > 1 && m_iteration == 1 )
+        fprintf( stderr, "ignoring %d threads in incremental mode. ", m_threadCount );
 
-        Pattern* p1 =r1.pattern();
-        assert( p1->isActive() );
-       // if( p1->isTabu() ) continue;
+    // In the first iteration all instances are singletons, which are counted from the matrix directly
+    const bool counted =!record && m_iteration == 1 && countSingletonCandidates();
+    if( !counted ) {
+        if( !record && m_threadCount > 1 ) {
+            countCandidatesParallel();
+        } else {
+            for( int i =0; i < m_instvec.size(); i++ ) {
+                if( m_instvec.isEmpty( i ) ) continue;
 
-        if( progress++ % (total/10+1) == 0 )
-          std::cerr << progress*100/total << "% ";
+                if( progress++ % (total/10+1) == 0 )
+                  std::cerr << progress*100/total << "% ";
 
-        int overlap_coeff =0; // Only if p1 == p2
+                countCandidates( i, i | odd, record ? &m_instanceCandidates[i] : nullptr );
+            }
+        }
+    }
 
-        // Get the periphery of r1's pattern
-        const Vouw::Pattern::PeripheryT& post =p1->periphery( Vouw::Pattern::PosteriorPeriphery );
+    m_changedInstances.clear();
+    m_candidatesValid =record;
 
-        // Iterate over all instances in r1's periphery
-        for( int j =0; j < post.size(); j++ ) {
-            Vouw::Coord2D coord = post[j].abs( r1.pivot() );
-            InstanceMatrix::IndexT idx = m_instmat[coord];
-            if( idx == m_instmat.empty ) continue;
+    std::cerr << std::endl << m_candidates.size() << " canditates found. Capacity: " << m_candidates.capacity() << std::endl;
+  /*  for( auto && inst : m_instvec ) { 
+        inst.marker() = -1;
+        inst.bitmask().clear();
+    }*/
+}
 
-            if( m_instanceMarker[idx] == (i | odd) ) continue;
-            m_instanceMarker[idx] =(i | odd);
+/** Counts the candidates of the first iteration directly from the matrix. All instances are singletons,
+ *  such that a candidate is a pair of values at one of the four posterior offsets E, SW, S and SE.
+ *  These are counted by scanning the rows into a dense histogram over (offset, value, value),
+ *  by population counts over the words of the rows if the matrix is bit-packed.
+ *  Pairs of the same pattern follow the overlap rule of countCandidates(): along a run of such pairs
+ *  in the direction of the offset, only every other pair is counted.
+ *  Returns false without counting if the instances do not map one-to-one to the matrix 
+ *  or there are too many distinct values. */
+bool
+Encoder::countSingletonCandidates() {
+    const int maxValues =256;
+    if( m_smap.empty() || m_smap.size() > maxValues || m_smap.rbegin()->first > UINT16_MAX ) return false;
+    if( m_ct->countIfActiveNonSingleton() != 0 || totalCount() != (int)m_mat->count() ) return false;
+
+    // Dense ids of the values, in increasing order of value
+    const int k =m_smap.size();
+    std::vector<uint8_t> valueId( m_smap.rbegin()->first + 1, 0 );
+    std::vector<Matrix2D::ElementT> values;
+    std::vector<Pattern*> patterns;
+    std::vector<Variant*> variants;
+    std::vector<uint8_t> isFirst, isSecond;
+    for( auto&& pair : m_smap ) {
+        Pattern* p =pair.second.first;
+        valueId[pair.first] =patterns.size();
+        values.push_back( pair.first );
+        patterns.push_back( p );
+        variants.push_back( pair.second.second );
+        // The tabu value itself has no instances, but other values may be a variant of its pattern
+        const bool hasInstance =!p->isTabu() || p->elements().front().value != pair.first;
+        isFirst.push_back( hasInstance );
+        isSecond.push_back( hasInstance && !p->isTabu() );
+    }
 
-            Instance& r2 = m_instvec[idx];
-            if( r2.empty() ) continue; // No instance at this coord
+    enum { East, SouthWest, South, SouthEast, Offsets };
+    const int rowOffset[Offsets] ={ 0, 1, 1, 1 };
+    const int colOffset[Offsets] ={ 1, -1, 0, 1 };
+
+    const int width =m_mat->width(), height =m_mat->height();
+    std::vector<int> histogram( Offsets * k * k, 0 );
+    if( m_mat->isBitPacked() && k <= 2 ) {
+        /* The same scan over the words of a bit-packed matrix. Each of the values 0 and 1 is a mask over
+         * 64 columns, such that the pairs of two values are counted by a population count. The pairs of 
+         * the same pattern that are counted are a mask as well, which marks the next row as above. 
+         * Along a row, every other pair of a run is counted, starting at its first pair. */
+        const int words =m_mat->rowWords();
+        const uint64_t evenBits =0x5555555555555555ULL;
+        std::vector<uint64_t> counted( words ), markedBits[Offsets];
+        for( int d =SouthWest; d < Offsets; d++ )
+            markedBits[d].assign( words, 0 );
+        // The columns [@begin,@end) of word @w
+        auto columns =[]( int w, int begin, int end ) -> uint64_t {
+            const int lo =std::max( begin - 64*w, 0 ), hi =std::min( end - 64*w, 64 );
+            if( lo >= hi ) return 0;
+            return (hi == 64 ? ~0ULL : (1ULL << hi) - 1) & ~((1ULL << lo) - 1);
+        };
+        auto popcount =[]( uint64_t x ) { return (int)std::bitset<64>( x ).count(); };
+
+        for( int r =0; r < height; r++ ) {
+            for( int d =East; d < Offsets && r + rowOffset[d] < height; d++ ) {
+                int* hist =&histogram[d * k * k];
+                const int dc =colOffset[d];
+                const uint64_t* marked =d == East ? nullptr : markedBits[d].data();
+                uint64_t carry =0;
+                for( int w =0; w < words; w++ ) {
+                    const uint64_t valid =columns( w, std::max( 0, -dc ), std::min( width, width - dc ) );
+                    const uint64_t first =m_mat->bitWindow( r, 64*w ), second =m_mat->bitWindow( r + rowOffset[d], 64*w + dc );
+                    uint64_t pairs[2][2];
+                    uint64_t same =0;
+                    for( int a =0; a < k; a++ ) {
+                        for( int b =0; b < k; b++ ) {
+                            const Matrix2D::ElementT va =values[a], vb =values[b];
+                            pairs[a][b] =0;
+                            if( va > 1 || vb > 1 || !isFirst[a] || !isSecond[b] ) continue;
+                            pairs[a][b] =(va ? first : ~first) & (vb ? second : ~second) & valid;
+                            if( patterns[a] == patterns[b] ) same |= pairs[a][b];
+                        }
+                    }
 
-           // if( r2.marker() == i ) continue;
-           // r2.marker() =i; // Make sure we do not visit this instance again
+                    uint64_t count;
+                    if( d == East ) {
+                        // The runs that start at an even column are cleared by adding their first bit
+                        const uint64_t run =same & ~carry;
+                        const uint64_t starts =run & ~(run << 1);
+                        const uint64_t evenRuns =run & ~(run + (starts & evenBits));
+                        count =(evenRuns & evenBits) | (run & ~evenRuns & ~evenBits);
+                        carry =count >> 63;
+                    } else
+                        count =same & ~marked[w];
+                    counted[w] =count;
+
+                    for( int a =0; a < k; a++ )
+                        for( int b =0; b < k; b++ )
+                            hist[a * k + b] += popcount( patterns[a] == patterns[b] ? pairs[a][b] & count : pairs[a][b] );
+                }
+                if( d == East ) continue;
+
+                // The second element of a counted pair at column c is at column c+dc of the next row
+                for( int w =0; w < words; w++ ) {
+                    if( dc == 0 )
+                        markedBits[d][w] =counted[w];
+                    else if( dc > 0 )
+                        markedBits[d][w] =(counted[w] << 1) | (w > 0 ? counted[w-1] >> 63 : 0);
+                    else
+                        markedBits[d][w] =(counted[w] >> 1) | (w+1 < words ? counted[w+1] << 63 : 0);
+                }
+            }
+        }
+    } else {
+        std::vector<uint8_t> row( width ), below( width );
+        // Whether an element is the second of a counted pair of the same pattern, for each offset to the next row
+        std::vector<uint8_t> marked[Offsets], markedBelow[Offsets];
+        for( int d =SouthWest; d < Offsets; d++ ) {
+            marked[d].assign( width, 0 );
+            markedBelow[d].assign( width, 0 );
+        }
 
+        std::vector<Matrix2D::ElementT> rowValues( width );
+        auto read_row =[&]( int r, std::vector<uint8_t>& ids ) {
+            m_mat->readRow( r, rowValues.data() );
+            for( int c =0; c < width; c++ )
+                ids[c] =valueId[rowValues[c]];
+        };
+
+        read_row( 0, row );
+        for( int r =0; r < height; r++ ) {
+            // East, the mark is carried along the row
+            int* hist =&histogram[East * k * k];
+            uint8_t carry =0;
+            for( int c =0; c+1 < width; c++ ) {
+                const int a =row[c], b =row[c+1];
+                const uint8_t same =patterns[a] == patterns[b];
+                const uint8_t count =isFirst[a] & isSecond[b] & !(same & carry);
+                carry =same & count;
+                hist[a * k + b] += count;
+            }
+            if( r+1 == height ) break;
+
+            read_row( r+1, below );
+            for( int d =SouthWest; d < Offsets; d++ ) {
+                hist =&histogram[d * k * k];
+                const int dc =colOffset[d];
+                const int cmin =std::max( 0, -dc ), cmax =std::min( width, width - dc );
+                std::fill( markedBelow[d].begin(), markedBelow[d].end(), 0 );
+                for( int c =cmin; c < cmax; c++ ) {
+                    const int a =row[c], b =below[c+dc];
+                    const uint8_t same =patterns[a] == patterns[b];
+                    const uint8_t count =isFirst[a] & isSecond[b] & !(same & marked[d][c]);
+                    markedBelow[d][c+dc] =same & count;
+                    hist[a * k + b] += count;
+                }
+                marked[d].swap( markedBelow[d] );
+            }
+            row.swap( below );
+        }
+    }
+
+    for( int d =0; d < Offsets; d++ ) {
+        const Pattern::OffsetT offset( rowOffset[d], colOffset[d] );
+        for( int a =0; a < k; a++ ) {
+            for( int b =0; b < k; b++ ) {
+                const int n =histogram[(d * k + a) * k + b];
+                if( !n ) continue;
+                Candidate c = { patterns[a], patterns[b], variants[a], variants[b], offset };
+                m_candidates.add( m_candidates.key( c ), n );
+            }
+        }
+    }
+    fprintf( stderr, "counted from the matrix. " );
+    return true;
+}
+
+/** Counts the candidates using multiple threads, each over a band of consecutive instances.
+ *  The pairs of equal patterns are then resolved in parallel by pattern and overlap coefficient,
+ *  to obtain exactly the same counts as the serial search, after which the per-thread maps are merged.
+ *  The overlap masks are not kept, as the candidate map is not updated incrementally afterwards. */
+void
+Encoder::countCandidatesParallel() {
+    const InstanceVector::IndexT n =m_instvec.size();
+    const int bands =std::max( 1, std::min<int>( m_threadCount, n / 1024 ) );
+    std::vector<CandidateShardT> shards( bands );
+    std::vector<std::thread> threads;
+    for( auto&& shard : shards ) shard.selfPairs.resize( bands );
+
+    // The processor time of the process is summed over all threads
+    TimeVarT t1 = timeNow();
+    const std::clock_t c1 =std::clock();
+
+    for( int b =0; b < bands; b++ ) {
+        threads.emplace_back( &Encoder::countCandidateShard, this, 
+                (InstanceVector::IndexT)((uint64_t)n * b / bands), 
+                (InstanceVector::IndexT)((uint64_t)n * (b+1) / bands),
+                &shards[b] );
+    }
+    for( auto&& t : threads ) t.join();
+    threads.clear();
+
+    TimeVarT t2 = timeNow();
+    const std::clock_t c2 =std::clock();
+
+    // Pairs of the same pattern may overlap, see countCandidates()
+    for( int b =0; b < bands; b++ )
+        threads.emplace_back( &Encoder::resolveSelfPairs, this, std::cref( shards ), b, &shards[b].candidates );
+    for( auto&& t : threads ) t.join();
+
+    TimeVarT t3 = timeNow();
+    const std::clock_t c3 =std::clock();
+
+    // Reduction of the per-thread maps
+    std::size_t total =0;
+    for( auto&& shard : shards ) total += shard.candidates.size();
+    m_candidates.reserve( total );
+    for( auto&& shard : shards ) {
+        for( auto&& e : shard.candidates )
+            m_candidates.add( m_candidates.key( shard.candidates.candidate( e.key ) ), e.count );
+        shard.candidates.clear();
+    }
+
+    TimeVarT t4 = timeNow();
+    const std::clock_t c4 =std::clock();
+
+    // Elapsed and processor time per phase. The processor time is not a speedup: compare the elapsed
+    // time to that of a single thread (-vj=1) on the same input instead
+    auto cpu =[]( std::clock_t a, std::clock_t b ) { return (long)((b - a) * 1000 / CLOCKS_PER_SEC); };
+    fprintf( stderr, "counted using %d threads in %ld ms (%ld ms processor time), "
+                     "resolved overlaps in %ld ms (%ld ms), reduced in %ld ms (%ld ms). ",
+            bands, (long)duration( t2-t1 ), cpu( c1, c2 ), (long)duration( t3-t2 ), cpu( c2, c3 ),
+            (long)duration( t4-t3 ), cpu( c3, c4 ) );
+}
+
+/** Counts the candidates of the instances in [@begin,@end) into @shard. 
+ *  Only reads the instance vector and matrix and may run concurrently. */
+void
+Encoder::countCandidateShard( InstanceVector::IndexT begin, InstanceVector::IndexT end, CandidateShardT* shard ) {
+    // Visit each neighboring instance only once, as in countCandidates(). The visited instances
+    // are kept in a set by open addressing of at least twice the size of the periphery,
+    // of which only the used slots are cleared after each instance
+    std::vector<InstanceVector::IndexT> visited;
+    std::vector<std::size_t> used;
+
+    for( InstanceVector::IndexT i =begin; i < end; i++ ) {
+        const Instance r1 =m_instvec[i];
+        if( r1.empty() ) continue;
+
+        Pattern* p1 =r1.pattern();
+        const Vouw::Pattern::PeripheryDeltaT& post =p1->peripheryDelta( Vouw::Pattern::PosteriorPeriphery );
+        const InstanceMatrix::KeyT key =m_instmat.key( r1.pivot() );
+
+        std::size_t capacity =16;
+        while( capacity < 2 * post.size() ) capacity *= 2;
+        if( visited.size() < capacity ) visited.resize( capacity, InstanceVector::nullIndex );
+        for( auto&& k : used ) visited[k] =InstanceVector::nullIndex;
+        used.clear();
+        // Inserts @idx and returns false if it was already visited
+        auto visit =[&]( InstanceVector::IndexT idx ) {
+            for( std::size_t k =(idx * 0x9e3779b1U) & (capacity-1); ; k =(k+1) & (capacity-1) ) {
+                if( visited[k] == idx ) return false;
+                if( visited[k] == InstanceVector::nullIndex ) {
+                    visited[k] =idx;
+                    used.push_back( k );
+                    return true;
+                }
+            }
+        };
+
+        for( auto&& delta : post ) {
+            InstanceMatrix::IndexT idx = m_instmat.at( key + delta );
+            if( idx == m_instmat.empty ) continue;
+
+            if( !visit( idx ) ) continue;
+
+            const Instance r2 =m_instvec[idx];
+            if( r2.empty() ) continue;
             if( r2.pivot().row() < r1.pivot().row() ) continue; // Edge case in the periphery representation
 
             Pattern* p2 =r2.pattern();
-
             if( p2->isTabu() ) continue;
 
-            Pattern::OffsetT offset( r1.pivot(), r2.pivot() );
             if( p1 == p2 ) {
-                overlap_coeff =overlapCoeff( r1.pivot(), r2.pivot(), p1->bounds() );
-
-                /*r1.bitmaskGrow( overlap_coeff+1 );
-                if( r1.bitmask()[overlap_coeff] ) continue;
-                r2.bitmaskGrow( overlap_coeff+1 );
-                r2.bitmask()[overlap_coeff] = true;*/
-                if( m_overlapMask[i].size() < overlap_coeff+1 ) m_overlapMask[i].resize( overlap_coeff+1 );
-                if( m_overlapMask[i][overlap_coeff] ) continue;
+                // Partition by pattern and overlap coefficient, see resolveSelfPairs()
+                const int coeff =overlapCoeff( r1.pivot(), r2.pivot(), p1->bounds() );
+                const int part =(p1->label() * 0x9e3779b1U + (uint32_t)coeff) % shard->selfPairs.size();
+                shard->selfPairs[part].push_back( { i, idx, coeff } );
+                continue;
+            }
+            
+            Candidate c = { p1, p2, (Variant*)r1.variant(), (Variant*)r2.variant(), Pattern::OffsetT( r1.pivot(), r2.pivot() ) };
+            shard->candidates.increment( c );
+        }
+    }
+}
+
+/** Counts the pairs of equal patterns collected in partition @part of @shards into @candidates.
+ *  A pair is only counted if its first instance is not already the second of a counted pair with 
+ *  the same overlap coefficient. This only depends on the earlier pairs of the same pattern and coefficient, 
+ *  which are in the same partition and visited in the same order as by countCandidates(). */
+void
+Encoder::resolveSelfPairs( const std::vector<CandidateShardT>& shards, int part, CandidateTable* candidates ) {
+    // Set of the marked instances and coefficients by open addressing, each pair marks at most one
+    std::size_t pairs =0;
+    for( auto&& shard : shards ) pairs += shard.selfPairs[part].size();
+    int bits =4;
+    while( ((std::size_t)1 << bits) < 2 * pairs ) bits++;
+    const std::size_t capacity =(std::size_t)1 << bits;
+    const int shift =64 - bits;
+    const uint64_t emptySlot =UINT64_MAX;
+    std::vector<uint64_t> marked( capacity, emptySlot );
+    // Returns the slot of @i and @coeff, or the empty slot where it would be inserted
+    auto find =[&]( InstanceVector::IndexT i, int coeff ) -> uint64_t& {
+        const uint64_t m =((uint64_t)i << 32) | (uint32_t)coeff;
+        for( std::size_t k =(m * 0x9e3779b97f4a7c15ULL) >> shift; ; k =(k+1) & (capacity-1) )
+            if( marked[k] == m || marked[k] == emptySlot ) return marked[k];
+    };
+
+    for( auto&& shard : shards ) {
+        for( auto&& sp : shard.selfPairs[part] ) {
+            if( find( sp.i, sp.overlapCoeff ) != emptySlot ) continue;
+            if( sp.idx > sp.i ) find( sp.idx, sp.overlapCoeff ) =((uint64_t)sp.idx << 32) | (uint32_t)sp.overlapCoeff;
+
+            const Instance r1 =m_instvec[sp.i];
+            const Instance r2 =m_instvec[sp.idx];
+            Candidate c = { r1.pattern(), r2.pattern(), (Variant*)r1.variant(), (Variant*)r2.variant(), Pattern::OffsetT( r1.pivot(), r2.pivot() ) };
+            candidates->increment( c );
+        }
+    }
+}
+
+/** Estimates the gain of the candidates in the slots [@begin,@end) of the candidate table
+ *  and appends those worth considering to @gainvec. Only reads the encoder's state. */
+void
+Encoder::computeGainShard( std::size_t begin, std::size_t end, int modelSize, CandidateGainVectorT* gainvec ) {
+    for( std::size_t i =begin; i < end; i++ ) {
+        if( !m_candidates.isOccupied( i ) ) continue;
+        const CandidateTable::EntryT& e =m_candidates.slot( i );
+        if( e.count <= 1 ) continue;
+        const Candidate c = m_candidates.candidate( e.key );
+
+        double gain = computeGain( &c, e.count, modelSize, totalCount() );
+        if( gain > 0.0 || m_iteration == 1) {
+            gainvec->push_back( CandidateGainT( c, gain ) );
+        }
+    }
+}
+
+/** Estimates the gain of all candidates using multiple threads and sorts the result.
+ *  Each thread sorts its own part, which are then merged. Because cg_gain_gt is a total order,
+ *  the resulting vector is identical to that of the serial path. */
+void
+Encoder::computeGainParallel( CandidateGainVectorT& gainvec, int modelSize ) {
+    const std::size_t slots =m_candidates.capacity();
+    const int n =m_threadCount;
+    std::vector<CandidateGainVectorT> shards( n );
+    std::vector<std::thread> threads;
+
+    for( int t =0; t < n; t++ ) {
+        threads.emplace_back( [this,&shards,slots,n,t,modelSize]() {
+            computeGainShard( slots * t / n, slots * (t+1) / n, modelSize, &shards[t] );
+            std::sort( shards[t].begin(), shards[t].end(), cg_gain_gt );
+        } );
+    }
+    for( auto&& t : threads ) t.join();
+
+    // Concatenate the sorted parts and merge them pairwise
+    std::vector<std::size_t> bounds( 1, 0 );
+    std::size_t total =0;
+    for( auto&& shard : shards ) total += shard.size();
+    gainvec.reserve( total );
+    for( auto&& shard : shards ) {
+        gainvec.insert( gainvec.end(), shard.begin(), shard.end() );
+        bounds.push_back( gainvec.size() );
+        CandidateGainVectorT().swap( shard );
+    }
+
+    while( bounds.size() > 2 ) {
+        std::vector<std::size_t> merged( 1, 0 );
+        for( int i =0; i+1 < bounds.size(); i += 2 ) {
+            if( i+2 < bounds.size() ) {
+                std::inplace_merge( gainvec.begin() + bounds[i], 
+                                    gainvec.begin() + bounds[i+1], 
+                                    gainvec.begin() + bounds[i+2], cg_gain_gt );
+                merged.push_back( bounds[i+2] );
+            } else
+                merged.push_back( bounds[i+1] );
+        }
+        bounds.swap( merged );
+    }
+
+    fprintf( stderr, "Using %d threads. ", n );
+}
+
+/** Chooses the candidates that are merged in one iteration: in the order of their gain, every candidate 
+ *  that shares no pattern with the candidates chosen before it. The candidates are taken from @sorted, 
+ *  or from @lazy if it is given. Nothing is merged, such that all gains are computed from the same model. */
+void
+Encoder::selectCandidates( const CandidateGainVectorT& sorted, LazySelectionT* lazy, CandidateGainVectorT& chosen ) {
+    const int maxMerge = m_heuristic == Best1 ? 1 : std::numeric_limits<int>::max();
+    std::vector<Pattern*> usedps; // We need indepedent candidates, i.e. disjunct sets of patterns
+    CandidateGainVectorT::const_iterator next =sorted.begin();
+
+    while( (int)chosen.size() < maxMerge ) {
+        const CandidateGainT* cg;
+        if( lazy ) {
+            if( !nextLazyCandidate( *lazy, usedps, cg ) ) break;
+        } else {
+            if( next == sorted.end() ) break;
+            cg = &(*next++);
+        }
+
+        if( std::find( usedps.begin(), usedps.end(), cg->first.p1 ) != usedps.end() ||
+            std::find( usedps.begin(), usedps.end(), cg->first.p2 ) != usedps.end() ) continue;
+
+        if( m_iteration == 1 && !chosen.empty() && cg->second < 0 ) break;
+
+        chosen.push_back( *cg );
+        usedps.push_back( cg->first.p1 );
+        usedps.push_back( cg->first.p2 );
+    }
+}
+
+/** Debug only: compares the candidates chosen by the lazy selection to those of the sorted selection */
+bool
+Encoder::checkSelection( const CandidateGainVectorT& chosen, int modelSize ) {
+    CandidateGainVectorT gainvec, expected;
+    computeGainShard( 0, m_candidates.capacity(), modelSize, &gainvec );
+    std::sort( gainvec.begin(), gainvec.end(), cg_gain_gt );
+    selectCandidates( gainvec, nullptr, expected );
+
+    bool equal =chosen.size() == expected.size();
+    for( std::size_t i =0; equal && i < chosen.size(); i++ )
+        equal =chosen[i].first == expected[i].first;
+    if( !equal )
+        fprintf( stderr, "\n*** Lazy selection of %d candidates does not match the %d sorted candidates! ***\n\n",
+                (int)chosen.size(), (int)expected.size() );
+    return equal;
+}
+
+/** Prepares the lazy-greedy selection. The candidates are grouped by usage, and the gain of each group
+ *  is bounded from the least usage of the patterns in it, see gainBoundByUsage().
+ *  The groups are then ordered by their bound, such that the candidates are sorted in two passes over the map */
+void
+Encoder::initLazySelection( LazySelectionT& sel, int modelSize ) {
+    sel.modelSize =modelSize;
+    sel.totalCount =totalCount();
+    sel.positiveOnly =m_iteration != 1;
+    sel.popped =false;
+    sel.evaluated =0;
+    sel.exact.clear();
+
+    // The patterns of the candidates are active, the union costs at least the values of two of them
+    std::vector<int> usage( m_ct->size(), 0 );
+    sel.minValuesLength =std::numeric_limits<double>::infinity();
+    for( int label : m_ct->activeLabels() ) {
+        const Pattern* p =m_ct->pattern( label );
+        usage[label] =p->usage();
+        sel.minValuesLength =std::min( sel.minValuesLength, p->entryValuesLength() );
+    }
+
+    // Per usage, the least usage of the first and second pattern of the candidates 
+    // and of the pattern of pairs of equal patterns, and the number of candidates
+    typedef std::array<int,4> GroupT;
+    const int none =std::numeric_limits<int>::max();
+    std::vector<GroupT> groups;
+    for( auto&& e : m_candidates ) {
+        if( e.count <= 1 ) continue;
+        if( e.count >= groups.size() ) groups.resize( e.count+1, GroupT{ { none, none, none, 0 } } );
+        GroupT& g =groups[e.count];
+        if( e.key.label1 == e.key.label2 ) {
+            g[2] =std::min( g[2], usage[e.key.label1] );
+        } else {
+            g[0] =std::min( g[0], usage[e.key.label1] );
+            g[1] =std::min( g[1], usage[e.key.label2] );
+        }
+        g[3]++;
+    }
+
+    sel.buckets.clear();
+    for( int u =2; u < groups.size(); u++ ) {
+        if( !groups[u][3] ) continue;
+        UsageBucketT b = { gainBoundByUsage( u, groups[u].data(), sel ), u, (std::size_t)groups[u][3] };
+        sel.buckets.push_back( b );
+    }
+    std::sort( sel.buckets.begin(), sel.buckets.end(), 
+            []( const UsageBucketT& a, const UsageBucketT& b ) { return a.bound > b.bound || (a.bound == b.bound && a.count > b.count); } );
+
+    // Counting sort of the keys by bucket
+    std::vector<std::size_t> first( groups.size() );
+    std::size_t end =0;
+    for( auto&& b : sel.buckets ) {
+        first[b.count] =end;
+        end += b.end;
+        b.end =end;
+    }
+    sel.keys.resize( end );
+    for( auto&& e : m_candidates )
+        if( e.count > 1 ) sel.keys[first[e.count]++] =e.key;
+    sel.next =0;
+    sel.bucket =0;
+}
+
+/** Returns the next candidate in the order of cg_gain_gt in @cg, or false if there are none left.
+ *  Candidates are only evaluated exactly when their bound is at least the best exact gain so far.
+ *  Candidates sharing a pattern with @usedps are discarded without evaluation. */
+bool
+Encoder::nextLazyCandidate( LazySelectionT& sel, const std::vector<Pattern*>& usedps, const CandidateGainT*& cg ) {
+    // The bound and the exact gain are summed in a different order
+    const double slack =1e-6;
+    auto gain_lt =[]( const CandidateGainT& a, const CandidateGainT& b ) { return cg_gain_gt( b, a ); };
+    auto is_used =[&usedps]( const Pattern* p ) { return std::find( usedps.begin(), usedps.end(), p ) != usedps.end(); };
+
+    // Remove the candidate that was returned previously
+    if( sel.popped ) {
+        std::pop_heap( sel.exact.begin(), sel.exact.end(), gain_lt );
+        sel.exact.pop_back();
+        sel.popped =false;
+    }
+
+    while( sel.next < sel.keys.size() ) {
+        while( sel.next == sel.buckets[sel.bucket].end ) sel.bucket++;
+        const UsageBucketT& b =sel.buckets[sel.bucket];
+        if( !sel.exact.empty() && b.bound + slack < sel.exact.front().second ) break;
+        if( sel.positiveOnly && b.bound + slack <= 0.0 ) {
+            sel.next =sel.keys.size();
+            break;
+        }
+
+        const Candidate c =m_candidates.candidate( sel.keys[sel.next++] );
+        if( is_used( c.p1 ) || is_used( c.p2 ) ) continue;
+
+        double gain =computeGain( &c, b.count, sel.modelSize, sel.totalCount );
+        assert( gain <= b.bound + slack );
+        sel.evaluated++;
+        if( gain > 0.0 || !sel.positiveOnly ) {
+            sel.exact.push_back( CandidateGainT( c, gain ) );
+            std::push_heap( sel.exact.begin(), sel.exact.end(), gain_lt );
+        }
+    }
+
+    if( sel.exact.empty() ) return false;
+    cg =&sel.exact.front();
+    sel.popped =true;
+    return true;
+}
+
+/** Returns an upper bound on computeGain() of the candidates with usage @usage of which the patterns are used
+ *  at least @minUsage[0] and @minUsage[1] times, or @minUsage[2] times if both patterns are equal.
+ *  A pattern is used at least @usage times, or twice that for equal patterns, and leaves the code table
+ *  if it is not used otherwise. Because log2Gamma() is convex, the code of a pattern that is used n times
+ *  gains less from giving up @usage instances as n increases. 
+ *  The values of a pattern cost at least the least Pattern::entryValuesLength() of the active patterns. */
+double
+Encoder::gainBoundByUsage( int usage, const int* minUsage, const LazySelectionT& sel ) {
+    const int none =std::numeric_limits<int>::max();
+    const int modelSize =sel.modelSize;
+    const int totalInstances =sel.totalCount - usage;
+    const double offsets =Pattern::entryOffsetsLength( 0, 0, 0, m_mat->width(), m_mat->height() );
+    const double codeLength =Pattern::codeLength( usage, 0, 0 );
+
+    // Code table normalization if @removed patterns leave the code table
+    auto norm =[&]( int removed ) {
+        const int newModelSize =modelSize + 1 - removed;
+        return uintCodeLength( modelSize ) - uintCodeLength( newModelSize )
+            + (log2Gamma( sel.totalCount, modelSize ) - log2Gamma( 0, modelSize )) 
+            - (log2Gamma( totalInstances, newModelSize ) - log2Gamma( 0, newModelSize )); 
+    };
+    // Gain of a pattern that stays in the code table, used at least @n times of which @k by the union, minus its values
+    auto keep =[&]( int n, int k ) {
+        n =std::max( n, k+1 );
+        return Pattern::codeLength( n, 0, 0 ) - Pattern::codeLength( n-k, 0, 0 ) - sel.minValuesLength;
+    };
+    // Gain of a pattern that leaves the code table: its code and entry, of which the values go to the union
+    const double drop =codeLength + offsets;
+
+    double bound =-std::numeric_limits<double>::infinity();
+    if( minUsage[0] != none ) {
+        const double gain[2][2] ={ { keep( minUsage[0], usage ), drop }, { keep( minUsage[1], usage ), drop } };
+        for( int r1 =0; r1 <= (int)(minUsage[0] == usage); r1++ )
+            for( int r2 =0; r2 <= (int)(minUsage[1] == usage); r2++ )
+                if( r1 + r2 <= modelSize )
+                    bound =std::max( bound, norm( r1 + r2 ) + gain[0][r1] + gain[1][r2] - codeLength - offsets );
+    }
+    if( minUsage[2] != none ) {
+        bound =std::max( bound, norm( 0 ) + keep( minUsage[2], 2*usage ) - sel.minValuesLength - codeLength - offsets );
+        if( minUsage[2] == 2*usage )
+            bound =std::max( bound, norm( 1 ) + Pattern::codeLength( 2*usage, 0, 0 ) - sel.minValuesLength - codeLength );
+    }
+    return bound;
+}
+
+/** Updates the candidate map using only the instances that were changed since the last search.
+ *  Each changed instance, together with all instances that may have it in their posterior periphery,
+ *  retracts its previous contribution to the map and is counted again. 
+ *  Instances are revisited in order, such that the overlap masks are equal to those of a full rebuild. */
+void
+Encoder::updateCandidateMap() {
+    typedef InstanceVector::IndexT IndexT;
+
+    // The dirty instances are stamped, such that each is added once, and visited in increasing order from a heap
+    if( m_dirtyMarker.size() < m_instvec.size() ) m_dirtyMarker.resize( m_instvec.size(), 0 );
+    if( ++m_dirtyStamp == 0 ) {
+        std::fill( m_dirtyMarker.begin(), m_dirtyMarker.end(), 0 );
+        m_dirtyStamp =1;
+    }
+    std::vector<IndexT> dirty;
+    std::size_t updated =0;
+    auto mark_dirty =[&]( IndexT i ) {
+        if( m_dirtyMarker[i] == m_dirtyStamp ) return;
+        m_dirtyMarker[i] =m_dirtyStamp;
+        dirty.push_back( i );
+        std::push_heap( dirty.begin(), dirty.end(), std::greater<IndexT>() );
+        updated++;
+    };
+
+    // The anterior and posterior peripheries together enclose the instance completely
+    for( auto i : m_changedInstances ) {
+        mark_dirty( i );
+        const Instance r =m_instvec[i];
+        if( r.empty() ) continue;
+        const InstanceMatrix::KeyT key =m_instmat.key( r.pivot() );
+        for( int k =0; k < 2; k++ ) {
+            for( auto && delta : r.pattern()->peripheryDelta( (Pattern::PeripheryPosition)k ) ) {
+                InstanceMatrix::IndexT idx = m_instmat.at( key + delta );
+                if( idx != m_instmat.empty ) mark_dirty( idx );
+            }
+        }
+    }
+    m_changedInstances.clear();
+
+    // Elements marked during the iteration have a higher index and are visited as well
+    while( !dirty.empty() ) {
+        std::pop_heap( dirty.begin(), dirty.end(), std::greater<IndexT>() );
+        const IndexT i =dirty.back();
+        dirty.pop_back();
+        InstanceCandidatesT& rec =m_instanceCandidates[i];
+
+        for( auto && k : rec.candidates )
+            m_candidates.subtract( k );
+        rec.candidates.clear();
+
+        std::vector<OverlapT> overlaps;
+        overlaps.swap( rec.overlaps );
+        for( auto && o : overlaps )
+            m_overlapMask[o.first][o.second] =false;
+
+        if( !m_instvec.isEmpty( i ) )
+            countCandidates( i, m_markerStamp++, &rec );
+
+        // If the overlap masks of the following instances have changed, they need to be recounted
+        for( auto && o : overlaps ) 
+            if( std::find( rec.overlaps.begin(), rec.overlaps.end(), o ) == rec.overlaps.end() )
+                mark_dirty( o.first );
+        for( auto && o : rec.overlaps ) 
+            if( std::find( overlaps.begin(), overlaps.end(), o ) == overlaps.end() )
+                mark_dirty( o.first );
+    }
+
+    std::cerr << "updated " << updated << " instances." << std::endl << m_candidates.size() << " canditates found. Capacity: " << m_candidates.capacity() << std::endl;
+}
+
+/** Counts the candidates formed by instance @i and the instances in its posterior periphery.
+ *  @marker is used to visit each neighboring instance only once and should be unique for this call.
+ *  If @record is given, the contribution of @i is stored such that it can be retracted later. */
+void
+Encoder::countCandidates( InstanceVector::IndexT i, InstanceVector::IndexT marker, InstanceCandidatesT* record ) {
+    const Instance r1 =m_instvec[i];
+
+    Pattern* p1 =r1.pattern();
+    assert( p1->isActive() );
+   // if( p1->isTabu() ) continue;
+
+    int overlap_coeff =0; // Only if p1 == p2
+
+    // Get the periphery of r1's pattern
+    const Vouw::Pattern::PeripheryDeltaT& post =p1->peripheryDelta( Vouw::Pattern::PosteriorPeriphery );
+    const InstanceMatrix::KeyT key =m_instmat.key( r1.pivot() );
+
+    // Iterate over all instances in r1's periphery
+    for( int j =0; j < post.size(); j++ ) {
+        InstanceMatrix::IndexT idx = m_instmat.at( key + post[j] );
+        if( idx == m_instmat.empty ) continue;
+
+        if( m_instanceMarker[idx] == marker ) continue;
+        m_instanceMarker[idx] =marker;
+
+        const Instance r2 =m_instvec[idx];
+        if( r2.empty() ) continue; // No instance at this coord
+
+       // if( r2.marker() == i ) continue;
+       // r2.marker() =i; // Make sure we do not visit this instance again
+
+        if( r2.pivot().row() < r1.pivot().row() ) continue; // Edge case in the periphery representation
+
+        Pattern* p2 =r2.pattern();
+
+        if( p2->isTabu() ) continue;
+
+        Pattern::OffsetT offset( r1.pivot(), r2.pivot() );
+        if( p1 == p2 ) {
+            overlap_coeff =overlapCoeff( r1.pivot(), r2.pivot(), p1->bounds() );
+
+            /*r1.bitmaskGrow( overlap_coeff+1 );
+            if( r1.bitmask()[overlap_coeff] ) continue;
+            r2.bitmaskGrow( overlap_coeff+1 );
+            r2.bitmask()[overlap_coeff] = true;*/
+            if( m_overlapMask[i].size() < overlap_coeff+1 ) m_overlapMask[i].resize( overlap_coeff+1 );
+            if( m_overlapMask[i][overlap_coeff] ) continue;
+            // Instances before @i have already been counted, marking them has no effect
+            if( idx > i ) {
                 if( m_overlapMask[idx].size() < overlap_coeff+1 ) m_overlapMask[idx].resize( overlap_coeff+1 );
                 //m_overlapMask[idx].reserve( overlap_coeff+1 );
                 m_overlapMask[idx][overlap_coeff] = true;
+                if( record ) record->overlaps.push_back( OverlapT( idx, overlap_coeff ) );
             }
-            
-            // Increment the usage count of this particular combination
-            Candidate c = { p1, p2, (Variant*)r1.variant(), (Variant*)r2.variant(), offset };
-            m_candidates[c]++;
-
         }
+        
+        // Increment the usage count of this particular combination
+        Candidate c = { p1, p2, (Variant*)r1.variant(), (Variant*)r2.variant(), offset };
+        const CandidateKey k =m_candidates.key( c );
+        m_candidates.add( k );
+        if( record ) record->candidates.push_back( k );
     }
+}
 
-    std::cerr << std::endl << m_candidates.size() << " canditates found. Bucket count: " << m_candidates.bucket_count() << std::endl;
-  /*  for( auto && inst : m_instvec ) { 
-        inst.marker() = -1;
-        inst.bitmask().clear();
-    }*/
+/** Registers that instance @i was changed or cleared after the last candidate search */
+void
+Encoder::instanceChanged( InstanceVector::IndexT i ) {
+    if( m_candidateSearch == IncrementalSearch )
+        m_changedInstances.push_back( i );
 }
 
 double
@@ -476,8 +1388,10 @@ Encoder::processCandidate( const CandidateGainT& pair, bool& usedFloodFill, int&
 
     InstanceIndexVectorT insts; // Vector of instances changed by the merge 
 
-    mergePatterns( &cand, insts );
-    modelSize++;
+    // If the union was folded into an existing active pattern, the model does not grow.
+    // The changed instances are then not all instances of that pattern, so we cannot flood fill
+    const bool added =mergePatterns( &cand, insts );
+    if( added ) modelSize++;
     modelSize -= (int)prunePattern( cand.p1, true );
     if( cand.p1 != cand.p2 )
         modelSize -= (int)prunePattern( cand.p2, true );
@@ -488,7 +1402,7 @@ Encoder::processCandidate( const CandidateGainT& pair, bool& usedFloodFill, int&
     fprintf( stderr, "actual gain: %.3f\n", oldBits - m_encodedBits );
     
 
-    while( m_local == FloodFill && floodFill( insts, modelSize ) ) usedFloodFill =true;
+    while( added && m_local == FloodFill && floodFill( insts, modelSize ) ) usedFloodFill =true;
 //    if( floodFill( prime ) ) usedFloodFill = true;
 
 
@@ -507,28 +1421,44 @@ Encoder::processCandidate( const CandidateGainT& pair, bool& usedFloodFill, int&
     return oldBits - m_encodedBits;
 }
 
-void 
+/** Merges all instances of the candidate @c and appends the changed instances to @changelist.
+ *  Returns false if the union was folded into an identical pattern that was already active */
+bool
 Encoder::mergePatterns( const Candidate* c, InstanceIndexVectorT& changelist ) {
     // Create the merged pattern
     Pattern* p_union = new Pattern( *c->p1, *c->v1, *c->p2, *c->v2, c->offset );
-    addPattern( p_union );
+    // Another merge order may have produced the same pattern before, if so we use that one
+    Pattern::OffsetT shift;
+    Pattern* dup =findDuplicate( p_union, shift );
+    const bool added =!dup || !dup->isActive();
+    if( dup ) {
+        fprintf( stderr, "equal to '%4d', ", dup->label() );
+        delete p_union;
+        p_union =dup;
+        m_ct->setActive( p_union, true );
+    } else
+        addPattern( p_union );
+    const std::size_t oldPostings =m_postings[p_union->label()].size();
 
-    for( int i =0; i < m_instvec.size(); i++ ) {
-        Instance &r1 = m_instvec[i];
+    // Only visit the instances of p1, in order
+    const InstanceIndexVectorT& postings =m_postings[c->p1->label()];
+
+    for( auto i : postings ) {
+        const Instance r1 =m_instvec[i];
         if( r1.empty() ) continue;
 
         Pattern* p1 =r1.pattern();
         if( p1 != c->p1 ) continue;
         
         // Get the periphery of r1's pattern
-        const Vouw::Pattern::PeripheryT& post =p1->periphery( Vouw::Pattern::PosteriorPeriphery );
+        const Vouw::Pattern::PeripheryDeltaT& post =p1->peripheryDelta( Vouw::Pattern::PosteriorPeriphery );
+        const InstanceMatrix::KeyT key =m_instmat.key( r1.pivot() );
 
         // Iterate over all instances in r1's periphery
-        for( auto && p_offset : post ) {
-            Vouw::Coord2D coord = p_offset.abs( r1.pivot() );
-            InstanceMatrix::IndexT idx =m_instmat[coord];
+        for( auto && delta : post ) {
+            InstanceMatrix::IndexT idx =m_instmat.at( key + delta );
             if( idx == m_instmat.empty ) continue;
-            Instance& r2 =m_instvec[idx];
+            const Instance r2 =m_instvec[idx];
             if( r2.empty() ) continue; // No instance at this coord
 
             Pattern* p2 =r2.pattern();
@@ -546,12 +1476,15 @@ Encoder::mergePatterns( const Candidate* c, InstanceIndexVectorT& changelist ) {
                 v =m_es->makeNullVariant();
             }
 
-            Coord2D pivot =r1.pivot();
+            Coord2D pivot =shift.abs( r1.pivot() );
 
-            r2.clear(); // Mark for deletion later on
-            m_instvec[i] = Instance( p_union, pivot, v );
+            m_instvec.setEmpty( idx ); // Mark for deletion later on
+            m_instvec.set( i, Instance( p_union, pivot, v ) );
             m_instmat.place( i, m_instvec[i] );
+            addPosting( p_union, i );
             changelist.push_back( i );
+            instanceChanged( i );
+            instanceChanged( idx );
 
             p_union->usage()++;
             p1->usage()--;
@@ -560,20 +1493,42 @@ Encoder::mergePatterns( const Candidate* c, InstanceIndexVectorT& changelist ) {
             break;
         }
     }
+
+    trimPostings( c->p1 );
+    if( c->p2 != c->p1 )
+        trimPostings( c->p2 );
+    // The postings of an existing pattern were in order before and after the new ones
+    InstanceIndexVectorT& postings_union =m_postings[p_union->label()];
+    std::inplace_merge( postings_union.begin(), postings_union.begin() + oldPostings, postings_union.end() );
+
+    m_touchedPatterns.push_back( c->p1 );
+    m_touchedPatterns.push_back( c->p2 );
+    m_touchedPatterns.push_back( p_union );
+    return added;
 }
 
 void
 Encoder::addPattern( Pattern* p ) {
-    p->setLabel( m_lastLabel++ );
-    m_ct->push_back( p );
-    Configuration c( *p );
-    auto it =std::find( m_configvec.begin(), m_configvec.end(), c ); 
-    if( it == m_configvec.end() ) {
-        p->setConfiguration( m_configvec.size() ); // Index of the new element
-        m_configvec.push_back( c );
-    } else {
-        p->setConfiguration( it - m_configvec.begin() );
+    m_ct->add( p );
+    m_postings.resize( m_ct->size() );
+    p->setConfiguration( m_configs.id( Configuration( *p ) ) );
+    m_patternIndex.insert( std::make_pair( p->contentHash(), p ) );
+}
+
+/** Returns a pattern in the code table with the same elements as @p up to the position of the pivot,
+ *  or NULL if there is none. @shift is set to the offset from the pivot of @p to that of the duplicate.
+ *  Patterns of which the storage has been released are not considered */
+Pattern*
+Encoder::findDuplicate( const Pattern* p, Pattern::OffsetT& shift ) const {
+    auto range =m_patternIndex.equal_range( p->contentHash() );
+    for( auto it =range.first; it != range.second; it++ ) {
+        Pattern* q =it->second;
+        if( q != p && !q->isReleased() && q->hasSameElements( *p ) ) {
+            shift =Pattern::OffsetT( q->elements().front().offset, p->elements().front().offset );
+            return q;
+        }
     }
+    return NULL;
 }
 
 /** Noisy flood fill */
@@ -607,11 +1562,11 @@ Encoder::noisyFloodFill( InstanceIndexVectorT& insts, int& modelSize ) {
 
         // We need all instances to have the same neighboring pattern configuration/instance at the same offset
         for( auto i : insts ) {
-            const Instance& r1 =m_instvec[i];
+            const Instance r1 =m_instvec[i];
             Vouw::Coord2D coord = p_offset.abs( r1.pivot() );
             InstanceMatrix::IndexT j =m_instmat[coord];
             if( j == m_instmat.empty ) goto NO_MATCH;
-            const Instance& r2 =m_instvec[j];
+            const Instance r2 =m_instvec[j];
             if( r2.empty() ) goto NO_MATCH;
             if( r2.pattern() == p1 ) goto NO_MATCH;
             Pattern::OffsetT offset( r1.pivot(), r2.pivot() );
@@ -655,7 +1610,7 @@ Encoder::noisyFloodFill( InstanceIndexVectorT& insts, int& modelSize ) {
 
         // Compute the expected gain for this 'candidate'
         c = { p1, p2, nullptr, nullptr, i_offset };
-        gain +=computeGain( &c, insts.size(), modelSize );
+        gain +=computeGain( &c, insts.size(), modelSize, totalCount() );
         //fprintf( stderr, "\tfloodFill: expecting %.3f bits gain, ", gain );
 
         if( gain < 0.0 ) {
@@ -675,10 +1630,10 @@ Encoder::noisyFloodFill( InstanceIndexVectorT& insts, int& modelSize ) {
         else
             p_union =new Pattern( *p1, *v, *p2, *v, i_offset );
         p1->usage() =0;
-        p1->setActive( false );
+        m_ct->setActive( p1, false );
         /*p2->usage() -=insts.size();
         if( p2->usage() == 0 ) {
-            p2->setActive( false );
+            m_ct->setActive( p2, false );
             modelSize--;
         }*/
         p_union->usage() = insts.size();
@@ -687,34 +1642,42 @@ Encoder::noisyFloodFill( InstanceIndexVectorT& insts, int& modelSize ) {
 
         // Apply the merge
         for( auto & i : insts ) {
-            Instance& r1 =m_instvec[i];
+            const Instance r1 =m_instvec[i];
             Vouw::Coord2D coord = p_offset.abs( r1.pivot() );
             InstanceMatrix::IndexT i2 =m_instmat[coord];
-            Instance& r2 =m_instvec[i2];
+            const Instance r2 =m_instvec[i2];
             
             Coord2D pivot = is_anterior ? r2.pivot() : r1.pivot();
 
             r2.pattern()->usage()--;
             if( r2.pattern()->usage() == 0 ) {
-                r2.pattern()->setActive( false );
+                m_ct->setActive( r2.pattern(), false );
                 modelSize--;
             }
+            m_touchedPatterns.push_back( r2.pattern() );
 
             if( r2.pattern() != p2 ) {
                 // Encode error
                 errorMapDelta( m_errormap, *p2, *r2.pattern(), r2.pivot() );
             }
 
+            instanceChanged( i );
+            instanceChanged( i2 );
             if( is_anterior ) {
-                r1.clear();
+                m_instvec.setEmpty( i );
                 i = i2;
             }
-            else r2.clear(); // Mark for deletion later on
-            m_instvec[i] = Instance( p_union, pivot, v );
+            else m_instvec.setEmpty( i2 ); // Mark for deletion later on
+            m_instvec.set( i, Instance( p_union, pivot, v ) );
             m_instmat.place( i, m_instvec[i] );
 
             m_instanceCount--;
         }
+        setPostings( p_union, insts );
+        trimPostings( p2 );
+        m_touchedPatterns.push_back( p1 );
+        m_touchedPatterns.push_back( p2 );
+        m_touchedPatterns.push_back( p_union );
         totalMerges++;
         p1 =p_union;
         // Debug only
@@ -753,19 +1716,20 @@ Encoder::floodFill( InstanceIndexVectorT& insts, int& modelSize ) {
     for( auto p_offset : peri ) {
         p_offset =p_offset.translate( p_shift );
         Pattern::OffsetT i_offset;
-        Pattern *p2 = NULL, *p_union;
+        Pattern *p2 = NULL, *p_union, *dup;
+        Pattern::OffsetT shift;
         Variant *v;
-        bool is_anterior =false;
+        bool is_anterior =false, folded;
         Candidate c;
         double gain;
 
         // We need all instances to have the same neighboring pattern/instance at the same offset
         for( auto i : insts ) {
-            const Instance& r1 =m_instvec[i];
+            const Instance r1 =m_instvec[i];
             Vouw::Coord2D coord = p_offset.abs( r1.pivot() );
             InstanceMatrix::IndexT j =m_instmat[coord];
             if( j == m_instmat.empty ) goto NO_MATCH;
-            const Instance& r2 =m_instvec[j];
+            const Instance r2 =m_instvec[j];
             if( r2.empty() ) goto NO_MATCH;
             if( r2.pattern() == p1 ) goto NO_MATCH;
             Pattern::OffsetT offset( r1.pivot(), r2.pivot() );
@@ -780,7 +1744,7 @@ Encoder::floodFill( InstanceIndexVectorT& insts, int& modelSize ) {
 
         // Compute the expected gain for this 'candidate'
         c = { p1, p2, nullptr, nullptr, i_offset };
-        gain =computeGain( &c, insts.size(), modelSize );
+        gain =computeGain( &c, insts.size(), modelSize, totalCount() );
         //fprintf( stderr, "\tfloodfill: expecting %.3f bits gain, ", gain );
 
         if( gain < 0.0 ) {
@@ -799,38 +1763,65 @@ Encoder::floodFill( InstanceIndexVectorT& insts, int& modelSize ) {
         }
         else
             p_union =new Pattern( *p1, *v, *p2, *v, i_offset );
+        // Use an identical pattern from a different merge order, if there is one
+        dup =findDuplicate( p_union, shift );
+        folded =dup && dup->isActive();
+        if( dup ) {
+            delete p_union;
+            p_union =dup;
+            p_shift =p_shift.translate( shift.negate() ); // Periphery offsets follow the pivot of the duplicate
+        }
         p1->usage() =0;
-        p1->setActive( false );
+        m_ct->setActive( p1, false );
         p2->usage() -=insts.size();
         if( p2->usage() == 0 ) {
-            p2->setActive( false );
+            m_ct->setActive( p2, false );
             modelSize--;
         }
-        p_union->usage() = insts.size();
-
-        addPattern( p_union );
+        if( folded ) {
+            modelSize--; // p1 is replaced by a pattern that was already in the model
+            p_union->usage() += insts.size();
+        } else if( dup ) {
+            m_ct->setActive( p_union, true );
+            p_union->usage() = insts.size();
+        } else {
+            p_union->usage() = insts.size();
+            addPattern( p_union );
+        }
 
         // Apply the merge
         for( auto & i : insts ) {
-            Instance& r1 =m_instvec[i];
+            const Instance r1 =m_instvec[i];
             Vouw::Coord2D coord = p_offset.abs( r1.pivot() );
             InstanceMatrix::IndexT i2 =m_instmat[coord];
-            Instance& r2 =m_instvec[i2];
+            const Instance r2 =m_instvec[i2];
             
-            Coord2D pivot = is_anterior ? r2.pivot() : r1.pivot();
+            Coord2D pivot =shift.abs( is_anterior ? r2.pivot() : r1.pivot() );
 
+            instanceChanged( i );
+            instanceChanged( i2 );
             if( is_anterior ) {
-                r1.clear();
+                m_instvec.setEmpty( i );
                 i = i2;
             }
-            else r2.clear(); // Mark for deletion later on
-            m_instvec[i] = Instance( p_union, pivot, v );
+            else m_instvec.setEmpty( i2 ); // Mark for deletion later on
+            m_instvec.set( i, Instance( p_union, pivot, v ) );
             m_instmat.place( i, m_instvec[i] );
 
             m_instanceCount--;
         }
+        setPostings( p_union, insts, folded );
+        trimPostings( p2 );
+        m_touchedPatterns.push_back( p1 );
+        m_touchedPatterns.push_back( p2 );
+        m_touchedPatterns.push_back( p_union );
         totalMerges++;
         p1 =p_union;
+        // The instances no longer cover all instances of p1, which ends the flood fill
+        if( folded ) {
+            insts.clear();
+            break;
+        }
         // Debug only
        /* {
             double oldBits = m_encodedBits;
@@ -848,12 +1839,69 @@ NO_MATCH:;
     return totalMerges != 0;
 }
 
+/** Updates the code lengths and the total encoded size. Unless @full is set, 
+ *  only the patterns touched since the last update are recomputed. */
 double
-Encoder::updateCodeLengths() {
-    m_ct->updateCodeLengths( totalCount(), m_mat->distribution() );
+Encoder::updateCodeLengths( bool full ) {
+    if( full ) {
+        m_ct->updateCodeLengths( totalCount(), m_mat->distribution() );
+    } else {
+        m_ct->updateCodeLengths( totalCount(), m_mat->distribution(), m_touchedPatterns );
+
+        if( m_verifyCodeLengths ) {
+            const double bits =m_ct->totalLength();
+            m_ct->updateCodeLengths( totalCount(), m_mat->distribution() );
+            if( std::abs( bits - m_ct->totalLength() ) > 1e-6 )
+                fprintf( stderr, "\n*** Incremental code length %f does not match %f! ***\n\n", bits, m_ct->totalLength() );
+        }
+    }
+    m_touchedPatterns.clear();
     return (m_encodedBits =m_ct->totalLength());
 }
 
+/** L(CT) + L(D|CT) of a fixed model, with the usages counted by setFromMatrixUsing(). 
+ *  Only the patterns that are used are part of the code table, as after reencode(). */
+double
+Encoder::fixedModelLength() {
+    const int total =totalCount();
+    const int uniqueValues =m_mat->distribution().uniqueElements();
+    int ctSize =0;
+    for( auto u : m_fixedUsage ) 
+        if( u ) ctSize++;
+
+    double ct_bits =uintCodeLength( ctSize );
+    double inst_bits =log2Gamma( total, ctSize ) - log2Gamma( 0, ctSize );
+    for( int label =0; label < m_fixedUsage.size(); label++ ) {
+        const int usage =m_fixedUsage[label];
+        if( !usage ) continue;
+        const Pattern* p =label < m_ct->size() ? m_ct->pattern( label ) : m_escapes[label - m_ct->size()];
+        // The model is read-only, the entries of the patterns that were not active have not been computed
+        if( p->entryLength() != 0.0 )
+            ct_bits += p->entryLength();
+        else
+            ct_bits += Pattern::entryOffsetsLength( p->bounds().width, p->bounds().height, p->size(), m_mat->width(), m_mat->height() )
+                     + log2( uniqueValues ) * p->size();
+        inst_bits += Pattern::codeLength( usage, total, ctSize );
+    }
+    m_dataBits =inst_bits;
+    return ct_bits + inst_bits;
+}
+
+/** L(CT) + L(D|CT) of the code table that only holds the singletons of @distribution, 
+ *  which equals the size of setFromMatrix() before encoding */
+double
+Encoder::singletonLength( const MassFunction& distribution, int width, int height ) {
+    const int total =distribution.totalElements();
+    const int ctSize =distribution.uniqueElements();
+    double ct_bits =uintCodeLength( ctSize );
+    double inst_bits =log2Gamma( total, ctSize ) - log2Gamma( 0, ctSize );
+    for( auto pair : distribution ) {
+        ct_bits += Pattern::entryOffsetsLength( 1, 1, 1, width, height ) + log2( ctSize );
+        inst_bits += Pattern::codeLength( pair.second, total, ctSize );
+    }
+    return ct_bits + inst_bits;
+}
+
 double
 Encoder::computeCandidateEntryLength( const Candidate* c, bool debugPrint ) {
     Pattern::BoundsT bounds = {
@@ -881,7 +1929,7 @@ Encoder::computeCandidateEntryLength( const Candidate* c, bool debugPrint ) {
  * The return value is the difference in encoding side in bits.
  */
 double
-Encoder::computeGain( const Candidate* c, int usage, int modelSize, bool debugPrint ) {
+Encoder::computeGain( const Candidate* c, int usage, int modelSize, int totalCount, bool debugPrint ) {
 
     double bits = 0.0;
 
@@ -899,14 +1947,14 @@ Encoder::computeGain( const Candidate* c, int usage, int modelSize, bool debugPr
     //printf( "(%d,%d) new model size %d (was %d) ", c->offset.row(), c->offset.col(), newModelSize, m_ct->countIfActive() );
 
     // The new size of the instance set is determined by the predicted usage of the union pattern
-    const int totalInstances = totalCount() - usage;
+    const int totalInstances = totalCount - usage;
 
     // Temporary bias to account for the encoding of null-variants
     //bits += usage;
 
     // For the instance set to decode correctly, its cardinality need to be known in advance
-    //bits += uintCodeLength( totalCount() ) - uintCodeLength( totalInstances );
-    //bits += uintCodeLength( binom( m_mat->width() * m_mat->height(), totalCount() ) )
+    //bits += uintCodeLength( totalCount ) - uintCodeLength( totalInstances );
+    //bits += uintCodeLength( binom( m_mat->width() * m_mat->height(), totalCount ) )
     //     -  uintCodeLength( binom( m_mat->width() * m_mat->height(), totalInstances ) );
     // Idem for the model
     bits += uintCodeLength( modelSize ) - uintCodeLength( newModelSize );
@@ -914,10 +1962,10 @@ Encoder::computeGain( const Candidate* c, int usage, int modelSize, bool debugPr
     // Recompute code table and instance codewords based on the new model's size
     // We use the fact that -log(a/b) = log(b)-log(a)
     // Here we subtract the log(b) component and replace it with log(b+k)
-    //const int f =totalCount()+m_ct->countIfActive();
-    //bits += f * (log2( totalCount() ) - log2( totalInstances ));
-    bits += (lgamma( (double)totalCount() + pseudoCount * (double)modelSize ) / log(2) - lgamma( pseudoCount * (double)modelSize ) / log(2)) 
-            -(lgamma( (double)totalInstances + pseudoCount * (double)newModelSize ) / log(2) - lgamma( pseudoCount * (double)newModelSize ) / log(2)); 
+    //const int f =totalCount+m_ct->countIfActive();
+    //bits += f * (log2( totalCount ) - log2( totalInstances ));
+    bits += (log2Gamma( totalCount, modelSize ) - log2Gamma( 0, modelSize )) 
+            -(log2Gamma( totalInstances, newModelSize ) - log2Gamma( 0, newModelSize )); 
 
  
 
@@ -1005,8 +2053,8 @@ Encoder::computeDecompositionGain( const Pattern* p, int modelSize, bool debugPr
     // We use the fact that -log(a/b) = log(b)-log(a)
     // Here we subtract the log(b) component and replace it with log(b+k)
     const int f =totalCount()+m_ct->countIfActive();
-    bits += (lgamma( (double)totalCount() + pseudoCount * (double)modelSize ) / log(2) - lgamma( pseudoCount * (double)modelSize ) / log(2)) 
-            -(lgamma( (double)totalInstances + pseudoCount * (double)newModelSize ) / log(2) - lgamma( pseudoCount * (double)newModelSize ) / log(2)); 
+    bits += (log2Gamma( totalCount(), modelSize ) - log2Gamma( 0, modelSize )) 
+            -(log2Gamma( totalInstances, newModelSize ) - log2Gamma( 0, newModelSize )); 
 
     // Step 1. remove the bits of the instances and code table codeword of @p completely
     double codeLength =Pattern::codeLength( p->usage(), totalInstances, newModelSize );
@@ -1038,7 +2086,7 @@ Encoder::prunePattern( Pattern* p, bool onlyZeroPattern ) {
     if( p->usage() == 0 ) {
         //m_ct->remove( p );
         //delete p;
-        p->setActive( false );
+        m_ct->setActive( p, false );
         return false || onlyZeroPattern;
     }
     if( onlyZeroPattern || p->size() == 1 || p->isActive() == false ) return false;
@@ -1047,16 +2095,22 @@ Encoder::prunePattern( Pattern* p, bool onlyZeroPattern ) {
     double g =computeDecompositionGain( p, modelSize );
     if( g > 0.0 ) {
         fprintf( stderr, "The decompositon of %d would result in %f bits gain.\n", p->label(), g );
-        for( auto&& r : m_instvec ) {
-            if( !r.empty() && r.pattern() == p ) {
+        for( auto i : m_postings[p->label()] ) {
+            if( !m_instvec.isEmpty( i ) && m_instvec.pattern( i ) == p ) {
+                // decompose() appends to the instance vector, we pass it a copy
+                Instance r =m_instvec[i];
                 decompose( r );
-                r.clear();
+                m_instvec.setEmpty( i );
+                instanceChanged( i );
                 ((Pattern*)p)->usage()--;
             }
         }
+        m_postings[p->label()].clear();
+        m_touchedPatterns.push_back( p );
         //m_instvec.eraseIfNull( m_instvec.begin(), m_instvec.end() );
-        p->setActive( false );
+        m_ct->setActive( p, false );
         m_decompositions++;
+        invalidateCandidateMap();
         
         double oldBits = m_encodedBits;
         double oldIBits = m_instvec.totalCodeLength();
@@ -1094,7 +2148,9 @@ Encoder::decompose( Instance& inst ) {
         decompose( inst1 );
     } else {
         ((Pattern*)comp.p1)->usage()++;
+        m_touchedPatterns.push_back( (Pattern*)comp.p1 );
         m_instvec.push_back( inst1 );
+        addPosting( comp.p1, m_instvec.size()-1 );
         //m_instmat.place( inst1 );
     }
 
@@ -1103,29 +2159,107 @@ Encoder::decompose( Instance& inst ) {
         decompose( inst2 );
     } else {
         ((Pattern*)comp.p2)->usage()++;
+        m_touchedPatterns.push_back( (Pattern*)comp.p2 );
         m_instvec.push_back( inst2 );
+        addPosting( comp.p2, m_instvec.size()-1 );
         //m_instmat.place( inst2 );
     }
 }
 
+/** Appends instance @i to the postings of @p. Indices must be added in increasing order. */
+void
+Encoder::addPosting( const Pattern* p, InstanceVector::IndexT i ) {
+    if( p->label() >= m_postings.size() ) m_postings.resize( p->label()+1 );
+    m_postings[p->label()].push_back( i );
+}
+
+/** Replaces the postings of @p by @insts, or adds @insts to them if @merge is set. @insts may be in any order */
+void
+Encoder::setPostings( const Pattern* p, const InstanceIndexVectorT& insts, bool merge ) {
+    if( p->label() >= m_postings.size() ) m_postings.resize( p->label()+1 );
+    InstanceIndexVectorT& list =m_postings[p->label()];
+    if( merge )
+        list.insert( list.end(), insts.begin(), insts.end() );
+    else
+        list =insts;
+    std::sort( list.begin(), list.end() );
+}
+
+/** Removes the postings of @p that no longer refer to an instance of @p */
+void
+Encoder::trimPostings( const Pattern* p ) {
+    InstanceIndexVectorT& list =m_postings[p->label()];
+    list.erase( std::remove_if( list.begin(), list.end(), [this,p]( InstanceVector::IndexT i ) {
+                return m_instvec.isEmpty( i ) || m_instvec.pattern( i ) != p; } ), list.end() );
+}
+
 void 
 Encoder::rebuildInstanceMatrix( bool sort ) {
 
     // Free up space by compacting the instance vector
-    m_instvec.eraseIfEmpty( m_instvec.begin(), m_instvec.end() );
+    m_instvec.eraseIfEmpty();
 
     // The instance vector needs to be sorted at all time, 
     // if random insertion has taken place it needs to be resorted
     if( sort ) {
-        std::sort( m_instvec.begin(), m_instvec.end() );
+        m_instvec.sortByPivot();
     }
 
-    // Now the unfortunate part, repopulate the matrix with the altered indices from the array
+    // Now the unfortunate part, repopulate the matrix and postings with the altered indices from the array
+    for( auto&& list : m_postings ) list.clear();
     for( int i =0; i < m_instvec.size(); i++ ) {
         m_instmat.place( i, m_instvec[i] );
+        addPosting( m_instvec.pattern( i ), i );
     }
     m_instanceCount = m_instvec.size(); // This rarely equals, but now it does
 
+    // Instance indices have changed
+    invalidateCandidateMap();
+
+}
+
+/** Removes the cleared instances from the instance vector if they make up more than COMPACTION_RATIO of it,
+ *  or if @force is set. The order of the remaining instances is preserved and only the indices of the instances
+ *  that move are updated, such that the candidate map stays valid. There should be no pending changes. */
+void
+Encoder::compactInstances( bool force ) {
+    typedef InstanceVector::IndexT IndexT;
+    const IndexT n =m_instvec.size();
+    const IndexT cleared =n - m_instanceCount;
+    if( !cleared || (!force && cleared <= COMPACTION_RATIO * n) ) return;
+    assert( m_changedInstances.empty() );
+
+    std::vector<IndexT> remap;
+    m_instvec.eraseIfEmpty( &remap );
+    const IndexT size =m_instvec.size();
+
+    // Instances only move to a lower index, so we can move their bookkeeping in order
+    for( IndexT i =0; i < n; i++ ) {
+        const IndexT j =remap[i];
+        if( j == InstanceVector::nullIndex || j == i ) continue;
+        m_instmat.place( j, m_instvec[j] );
+        if( i < m_overlapMask.size() ) m_overlapMask[j].swap( m_overlapMask[i] );
+        if( i < m_instanceCandidates.size() ) std::swap( m_instanceCandidates[j], m_instanceCandidates[i] );
+    }
+    if( m_overlapMask.size() > size ) m_overlapMask.resize( size );
+    if( m_instanceCandidates.size() > size ) m_instanceCandidates.resize( size );
+    m_instanceMarker.assign( size, 1UL << 31 );
+
+    auto remapList = [&remap]( InstanceIndexVectorT& list ) {
+        IndexT k =0;
+        for( auto i : list ) 
+            if( remap[i] != InstanceVector::nullIndex ) list[k++] =remap[i];
+        list.resize( k );
+    };
+    for( auto&& list : m_postings ) remapList( list );
+    for( auto&& rec : m_instanceCandidates ) {
+        auto it =std::remove_if( rec.overlaps.begin(), rec.overlaps.end(), [&remap]( const OverlapT& o ) {
+                return remap[o.first] == InstanceVector::nullIndex; } );
+        rec.overlaps.erase( it, rec.overlaps.end() );
+        for( auto&& o : rec.overlaps ) o.first =remap[o.first];
+    }
+
+    std::cerr << "Compacted the instance vector from " << n << " to " << size << " instances." << std::endl;
 }
 
 VOUW_NAMESPACE_END
@@ -11,35 +11,17 @@
 #include <vouw/equivalence.h>
 #include <cmath>
 #include <cstdio>
+#include <cassert>
 
 VOUW_NAMESPACE_BEGIN
 
 /* class Instance implementation */
 
-Instance::Instance( Pattern* pattern, const Coord2D& pivot, const Variant* variant ) : 
-    m_pivot( pivot ),
-    m_variant( variant )/*,
-    m_marker( -1 )*/
-{
-    setPattern( pattern );
-}
-
-Instance::Instance() : m_variant(0) {}
-Instance::~Instance() {} 
-
 void
 Instance::apply( Matrix2D* mat ) {
 
 }
 
-void
-Instance::setPattern( Pattern* p ) {
-    m_pattern =p;
-   /* if( p ) {
-        bitmaskGrow( p->periphery( Pattern::PosteriorPeriphery ).size() );
-    }*/
-}
-
 /*void 
 Instance::setFlagged( bool b, DirT dir ) const { 
     if( b )
@@ -49,25 +31,109 @@ Instance::setFlagged( bool b, DirT dir ) const {
 }*/
 
 bool operator<(const Instance& r1, const Instance& r2) {
-    return r1.pivot().position() < r2.pivot().position();
+    return r1.pivot() < r2.pivot();
 }
 
 /* class InstanceVector implementation */
 
+const InstanceVector::IndexT InstanceVector::nullIndex;
+const uint32_t InstanceVector::nullLabel;
+
 InstanceVector::InstanceVector( int matWidth, int matHeight, int matBase) : 
-    std::vector<Instance>(), 
     m_bits( 0.0 ), m_stdBitsPerPivot( 0.0 ) {
     setMatrixSize( matWidth, matHeight, matBase );
 }
 
 InstanceVector::InstanceVector( const Matrix2D* mat ) : 
-    std::vector<Instance>(), 
     m_bits( 0.0 ), m_stdBitsPerPivot( 0.0 ) {
     setMatrixSize( mat->width(), mat->height(), mat->base() );
 }
 
 InstanceVector::~InstanceVector() {}
 
+void
+InstanceVector::reserve( std::size_t n ) {
+    m_labels.reserve( n );
+    m_pivots.reserve( n );
+    m_variantIds.reserve( n );
+}
+
+void
+InstanceVector::clear() {
+    m_labels.clear();
+    m_pivots.clear();
+    m_variantIds.clear();
+}
+
+void
+InstanceVector::push_back( const Instance& inst ) {
+    m_labels.push_back( nullLabel );
+    m_pivots.push_back( 0 );
+    m_variantIds.push_back( 0 );
+    set( size()-1, inst );
+}
+
+void
+InstanceVector::set( IndexT i, const Instance& inst ) {
+    uint32_t label =nullLabel;
+    if( inst.pattern() ) {
+        label =inst.pattern()->label();
+        if( label >= m_patterns.size() ) m_patterns.resize( label+1, NULL );
+        m_patterns[label] =inst.pattern();
+    }
+    m_labels[i] =label;
+    m_pivots[i] =((uint32_t)inst.pivot().row() << 16) | (uint32_t)inst.pivot().col();
+    m_variantIds[i] =variantId( inst.variant() );
+}
+
+void
+InstanceVector::eraseIfEmpty( std::vector<IndexT>* remap ) {
+    if( remap ) remap->assign( size(), nullIndex );
+    std::size_t n =0;
+    for( std::size_t i =0; i < size(); i++ ) {
+        if( m_labels[i] == nullLabel ) continue;
+        if( remap ) (*remap)[i] =n;
+        m_labels[n] =m_labels[i];
+        m_pivots[n] =m_pivots[i];
+        m_variantIds[n] =m_variantIds[i];
+        n++;
+    }
+    m_labels.resize( n );
+    m_pivots.resize( n );
+    m_variantIds.resize( n );
+}
+
+void
+InstanceVector::sortByPivot() {
+    if( std::is_sorted( m_pivots.begin(), m_pivots.end() ) ) return;
+
+    // Two stable counting passes, on the column and then on the row half of the pivot
+    std::vector<IndexT> order( size() ), tmp( size() );
+    for( IndexT i =0; i < order.size(); i++ ) order[i] =i;
+    std::vector<std::size_t> offsets;
+    for( int shift =0; shift < 32; shift += 16 ) {
+        offsets.assign( (1 << 16) + 1, 0 );
+        for( auto p : m_pivots ) 
+            offsets[((p >> shift) & 0xffff) + 1]++;
+        for( std::size_t b =1; b < offsets.size(); b++ )
+            offsets[b] += offsets[b-1];
+        for( auto i : order )
+            tmp[offsets[(m_pivots[i] >> shift) & 0xffff]++] =i;
+        order.swap( tmp );
+    }
+
+    std::vector<uint32_t> labels( size() ), pivots( size() );
+    std::vector<uint8_t> variantIds( size() );
+    for( IndexT i =0; i < order.size(); i++ ) {
+        labels[i] =m_labels[order[i]];
+        pivots[i] =m_pivots[order[i]];
+        variantIds[i] =m_variantIds[order[i]];
+    }
+    m_labels.swap( labels );
+    m_pivots.swap( pivots );
+    m_variantIds.swap( variantIds );
+}
+
 double 
 InstanceVector::bitsPerPivot( std::size_t pivotCount ) {
     return log2( (double) pivotCount );
@@ -89,9 +155,9 @@ void InstanceVector::updateCodeLengths( int modelSize ) {
 }
 
 void InstanceVector::clearBitmasks() {
-    for( auto& r : *this ) {
-    //    r.m_bitmask.assign( r.m_bitmask.size(), false );
-    }
+    /*for( auto& r : *this ) {
+        r.m_bitmask.assign( r.m_bitmask.size(), false );
+    }*/
 }
 /*void InstanceVector::unflagAll() {
     for( auto& r : *this ) {
@@ -103,6 +169,8 @@ void
 InstanceVector::setMatrixSize( int width, int height, int base ) { 
     m_width =width; m_height =height; m_base =base;
     m_nodeCount =width*height;
+    // The pivots are packed in 16 bits per dimension
+    assert( width <= 65536 && height <= 65536 );
 
     /*if( width>0 && height>0 ) {
         m_stdBitsPerPivot = log2( (double)m_nodeCount );
@@ -110,5 +178,17 @@ InstanceVector::setMatrixSize( int width, int height, int base ) {
 
 }
 
+/* Private functions */
+
+uint8_t
+InstanceVector::variantId( const Variant* v ) {
+    // There are only a few distinct variant objects
+    auto it =std::find( m_variants.begin(), m_variants.end(), v );
+    if( it != m_variants.end() ) return it - m_variants.begin();
+    assert( m_variants.size() <= UINT8_MAX );
+    m_variants.push_back( v );
+    return m_variants.size() - 1;
+}
+
 VOUW_NAMESPACE_END
 
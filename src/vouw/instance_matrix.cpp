@@ -6,46 +6,34 @@
  */
 
 #include "vouw/instance_matrix.h"
-#include <stdexcept>
+#include "vouw/pattern.h"
+#include <algorithm>
 
 VOUW_NAMESPACE_BEGIN
 
 InstanceMatrix::IndexT InstanceMatrix::empty = -1;
 
 InstanceMatrix::InstanceMatrix() 
-    : m_rowLength(0) {
+    : m_width( 0 ), m_height( 0 ), m_count( 0 ) {
 }
 
-InstanceMatrix::InstanceMatrix( int rowLength ) 
-    : m_rowLength( rowLength ) {
+InstanceMatrix::InstanceMatrix( int width, int height ) 
+    : m_count( 0 ) {
+    setSize( width, height );
 }
 
 InstanceMatrix::~InstanceMatrix() {}
 
 InstanceMatrix::IndexT 
-InstanceMatrix::at( const Coord2D& c ) {
-    if( c.col() >= m_rowLength || c.col() < 0 ) return empty;
-    MapT::iterator it = m_map.find( key( c ) );
-    if( it == m_map.end() ) return empty;
-    return it->second;
+InstanceMatrix::at( const Coord2D& c ) const {
+    return at( c.row(), c.col() );
 }
 
 InstanceMatrix::IndexT 
-InstanceMatrix::at( int row, int col ) {
-    if( col >= m_rowLength || col < 0 ) return empty;
-    MapT::iterator it = m_map.find( key( row, col ) );
-    if( it == m_map.end() ) return empty;
-    return it->second;
-}
-
-InstanceMatrix::IndexT 
-InstanceMatrix::operator[]( const Coord2D& c ) {
-    return at( c );
-}
-
-const InstanceMatrix::IndexT 
-InstanceMatrix::operator[]( const Coord2D& c ) const {
-    return (const IndexT)((InstanceMatrix*)this)->at(c);
+InstanceMatrix::at( int row, int col ) const {
+    if( col > m_width || col < -1 ) return empty;
+    if( row > m_height || row < -1 ) return empty;
+    return m_buffer[key( row, col )];
 }
 
 void 
@@ -56,36 +44,36 @@ InstanceMatrix::place( IndexT idx, const Instance& inst ) {
 void 
 InstanceMatrix::place( IndexT idx, const Instance& inst, const Coord2D& pivot ) {
     Pattern *p = inst.pattern();
+    const KeyT base = key( pivot );
     for( auto && elem : p->elements() ) {
-        Coord2D c = elem.offset.abs( pivot );
-        m_map[key(c)] = idx;
+        IndexT& i = m_buffer[base + elem.offset.row() * stride() + elem.offset.col()];
+        if( i == empty ) m_count++;
+        i = idx;
     }
 }
 
 void 
 InstanceMatrix::remove( const Instance& inst ) {
     Pattern *p = inst.pattern();
+    const KeyT base = key( inst.pivot() );
     for( auto && elem : p->elements() ) {
-        Coord2D c = elem.offset.abs( inst.pivot() );
-        m_map.erase( key(c) );
+        IndexT& i = m_buffer[base + elem.offset.row() * stride() + elem.offset.col()];
+        if( i != empty ) m_count--;
+        i = empty;
     }
-    //m_count--;
-}
-
-InstanceMatrix::KeyT
-InstanceMatrix::key( const Coord2D& c ) const {
-    return key( c.row(), c.col() );
 }
 
-InstanceMatrix::KeyT
-InstanceMatrix::key( int row, int col ) const {
-    return m_rowLength*row + col;
+void
+InstanceMatrix::setSize( int width, int height ) {
+    m_width =width; m_height =height;
+    m_buffer.assign( stride() * (height+2), empty );
+    m_count =0;
 }
 
 void
 InstanceMatrix::clear() {
-    m_map.clear();
-    //m_count =0;
+    std::fill( m_buffer.begin(), m_buffer.end(), empty );
+    m_count =0;
 }
 
 VOUW_NAMESPACE_END
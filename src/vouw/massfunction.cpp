@@ -6,92 +6,257 @@
  */
 
 #include <vouw/massfunction.h>
-#include <stdexcept>
 #include <algorithm>
+#include <cassert>
 
 VOUW_NAMESPACE_BEGIN
 
-MassFunction::MassFunction() :
+/* Values below this limit are counted in a flat array, 256KB at most */
+#define MASSFUNCTION_DENSE_MAX (1U << 16)
+
+/* Marks an unused slot of the hash table, this value cannot be counted in sparse mode */
+#define MASSFUNCTION_EMPTY_SLOT (~(MassFunction::ElementT)0)
+
+static inline std::size_t
+slotHash( MassFunction::ElementT n ) {
+    return (std::size_t)(((uint64_t)n * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+MassFunction::MassFunction( ElementT range ) :
+    m_dense( std::min( range, (ElementT)MASSFUNCTION_DENSE_MAX ), 0 ),
+    m_sparseSize( 0 ),
+    m_isDense( true ),
     m_lower( 0 ),
     m_upper( 0 ),
-    m_count( 0 ) {}
+    m_boundsValid( true ),
+    m_count( 0 ),
+    m_unique( 0 ) {}
 
-MassFunction::CountT 
+MassFunction::CountT
 MassFunction::count( const ElementT& n ) const {
-    CountT c;
-    try {
-        c = m_elements.at( n );
-    }
-    catch( const std::out_of_range& oor ) {
-        return 0;
-    }
-    return c;
+    const CountT* c =find( n );
+    return c ? *c : 0;
 }
 
-double 
+double
 MassFunction::p( const ElementT& n ) const {
     CountT c = count( n );
     return (double)c/(double)m_count;
 }
 
-void 
+void
 MassFunction::setCount( const ElementT& n, const CountT& c ) {
     CountT old_c = count( n );
     if( c == 0 ) {
         if( old_c == 0 ) return;
         erase( n );
     } else {
-        m_elements[n] = c;
-        if( n > m_upper ) m_upper =n;
-        if( m_count == 0 ) m_lower =n;
-        else if( n < m_lower ) m_lower =n;
+        insert( n ) = c;
         m_count += c - old_c;
+        if( old_c == 0 ) added( n );
     }
 }
 
-void 
+void
 MassFunction::decrement( const ElementT& n ) {
-    try {
-        CountT c = m_elements.at( n );
-        if( c != 0 ) {
-            if( c-1 == 0 ) {
-                erase( n );
-            } else {
-                m_elements.at( n )--;
-                m_count--;
-            }
+    CountT* c =const_cast<CountT*>( find( n ) );
+    if( !c || *c == 0 ) return;
+    (*c)--;
+    m_count--;
+    if( *c == 0 ) removed( n );
+}
+
+void
+MassFunction::increment( const ElementT& n ) {
+    CountT& c =insert( n );
+    c++;
+    m_count++;
+    if( c == 1 ) added( n );
+}
+
+template<typename T> void
+MassFunction::increment( const T* values, std::size_t n ) {
+    if( n == 0 ) return;
+
+    // Find the largest value first, such that the counts can be kept in a flat array
+    T max =0;
+    for( std::size_t i =0; i < n; i++ )
+        max =std::max( max, values[i] );
+
+    if( !m_isDense || max >= MASSFUNCTION_DENSE_MAX ) {
+        for( std::size_t i =0; i < n; i++ )
+            increment( values[i] );
+        return;
+    }
+
+    // Four partial histograms, such that successive increments of the same value do not wait for each other
+    const std::size_t range =max + 1;
+    std::vector<CountT> partial( 4 * range, 0 );
+    CountT *h0 =&partial[0], *h1 =h0 + range, *h2 =h1 + range, *h3 =h2 + range;
+    std::size_t i =0;
+    for( ; i+4 <= n; i += 4 ) {
+        h0[values[i]]++;
+        h1[values[i+1]]++;
+        h2[values[i+2]]++;
+        h3[values[i+3]]++;
+    }
+    for( ; i < n; i++ )
+        h0[values[i]]++;
+
+    if( m_dense.size() < range ) m_dense.resize( range, 0 );
+    for( ElementT v =0; v < range; v++ ) {
+        const CountT c =h0[v] + h1[v] + h2[v] + h3[v];
+        if( !c ) continue;
+        const bool isNew =m_dense[v] == 0;
+        m_dense[v] += c;
+        m_count += c;
+        if( isNew ) added( v );
+    }
+}
+
+template void MassFunction::increment( const uint8_t*, std::size_t );
+template void MassFunction::increment( const uint16_t*, std::size_t );
+template void MassFunction::increment( const uint32_t*, std::size_t );
+
+void
+MassFunction::erase( const ElementT& n ) {
+    CountT* c =const_cast<CountT*>( find( n ) );
+    if( !c || *c == 0 ) return;
+    m_count -= *c;
+    *c =0;
+    removed( n );
+}
+
+void
+MassFunction::clear() {
+    std::fill( m_dense.begin(), m_dense.end(), 0 );
+    m_sparse.clear();
+    m_sparseSize =0;
+    m_isDense =true;
+    m_lower =m_upper =m_count =m_unique =0;
+    m_boundsValid =true;
+}
+
+/* Private functions */
+
+MassFunction::EntryT
+MassFunction::entry( std::size_t i ) const {
+    if( m_isDense ) return EntryT( i, m_dense[i] );
+    const SlotT& s =m_sparse[i];
+    return EntryT( s.value, s.value == MASSFUNCTION_EMPTY_SLOT ? 0 : s.count );
+}
+
+/** Returns the count of @n, or NULL if @n has no slot */
+const MassFunction::CountT*
+MassFunction::find( ElementT n ) const {
+    if( m_isDense )
+        return n < m_dense.size() ? &m_dense[n] : NULL;
+    if( m_sparse.empty() ) return NULL;
+
+    const std::size_t mask =m_sparse.size() - 1;
+    for( std::size_t i =slotHash( n ) & mask; ; i =(i+1) & mask ) {
+        const SlotT& s =m_sparse[i];
+        if( s.value == n ) return &s.count;
+        if( s.value == MASSFUNCTION_EMPTY_SLOT ) return NULL;
+    }
+}
+
+/** Returns the count of @n, creating it if necessary */
+MassFunction::CountT&
+MassFunction::insert( ElementT n ) {
+    if( m_isDense ) {
+        if( n < m_dense.size() ) return m_dense[n];
+        if( n < MASSFUNCTION_DENSE_MAX ) {
+            m_dense.resize( std::min<std::size_t>( std::max<std::size_t>( n+1, 2 * m_dense.size() ), MASSFUNCTION_DENSE_MAX ), 0 );
+            return m_dense[n];
         }
+        makeSparse();
     }
-    catch( const std::out_of_range& oor ) {
-        return;
+    assert( n != MASSFUNCTION_EMPTY_SLOT );
+
+    if( (m_sparseSize + 1) * 2 > m_sparse.size() )
+        rehash( std::max<std::size_t>( 16, m_sparse.size() * 2 ) );
+
+    const std::size_t mask =m_sparse.size() - 1;
+    for( std::size_t i =slotHash( n ) & mask; ; i =(i+1) & mask ) {
+        SlotT& s =m_sparse[i];
+        if( s.value == n ) return s.count;
+        if( s.value == MASSFUNCTION_EMPTY_SLOT ) {
+            s.value =n;
+            s.count =0;
+            m_sparseSize++;
+            return s.count;
+        }
     }
 }
 
-void 
-MassFunction::increment( const ElementT& n ) {
-    m_elements[n]++;
-    m_count++;
+/** Called when the count of @n has become non-zero */
+void
+MassFunction::added( ElementT n ) {
+    if( m_unique++ == 0 ) {
+        m_lower =m_upper =n;
+        m_boundsValid =true;
+        return;
+    }
+    // Widening keeps the bounds enclosing, even when they are not tight
+    if( n < m_lower ) m_lower =n;
     if( n > m_upper ) m_upper =n;
-    if( m_count == 0 ) m_lower =n;
-    else if( n < m_lower ) m_lower =n;
 }
 
-void 
-MassFunction::erase( const ElementT& n ) {
-    CountT c = count( n );
-    if( c == 0 ) return;
-    m_count -= c;
-    m_elements.erase( n );
+/** Called when the count of @n has become zero */
+void
+MassFunction::removed( ElementT n ) {
+    m_unique--;
+    if( n == m_lower || n == m_upper )
+        m_boundsValid =false;
+}
 
-    auto result =std::minmax_element( m_elements.begin(), m_elements.end() );
-    m_lower = (*result.first).first;
-    m_upper = (*result.second).first;
+void
+MassFunction::makeSparse() {
+    std::vector<CountT> dense;
+    dense.swap( m_dense );
+    m_isDense =false;
+    m_sparse.clear();
+    m_sparseSize =0;
+    rehash( 16 );
+    for( ElementT v =0; v < dense.size(); v++ )
+        if( dense[v] ) insert( v ) =dense[v];
 }
 
+/** Rebuilds the hash table with @capacity slots, dropping the values with a zero count */
 void
-MassFunction::clear() {
-    m_elements.clear();
-    m_lower =m_upper =m_count =0;
+MassFunction::rehash( std::size_t capacity ) {
+    std::vector<SlotT> old;
+    old.swap( m_sparse );
+    while( capacity < m_unique * 2 + 2 ) capacity *= 2;
+    SlotT empty = { MASSFUNCTION_EMPTY_SLOT, 0 };
+    m_sparse.assign( capacity, empty );
+    m_sparseSize =0;
+    for( auto&& s : old )
+        if( s.value != MASSFUNCTION_EMPTY_SLOT && s.count ) insert( s.value ) =s.count;
+}
+
+/** Tightens the bounds after the removal of an outer value.
+ *  In dense mode the bounds move inwards from their old position */
+void
+MassFunction::updateBounds() const {
+    m_boundsValid =true;
+    if( m_unique == 0 ) {
+        m_lower =m_upper =0;
+        return;
+    }
+    if( m_isDense ) {
+        while( !m_dense[m_lower] ) m_lower++;
+        while( !m_dense[m_upper] ) m_upper--;
+        return;
+    }
+    bool first =true;
+    for( auto&& s : m_sparse ) {
+        if( s.value == MASSFUNCTION_EMPTY_SLOT || !s.count ) continue;
+        if( first || s.value < m_lower ) m_lower =s.value;
+        if( first || s.value > m_upper ) m_upper =s.value;
+        first =false;
+    }
 }
 
 VOUW_NAMESPACE_END
@@ -8,126 +8,117 @@
 #include <vouw/matrix.h>
 #include <vouw/massfunction.h>
 #include <algorithm>
+#include <bitset>
 
 VOUW_NAMESPACE_BEGIN
 
-/* class Coord2D implementation */
-
-int Coord2D::position() const {
-    return rowLength()*row() + col();
-}
-
-bool operator==( const Coord2D& c1, const Coord2D& c2 ) {
-    return c1.row() == c2.row() && c1.col() == c2.col();
-}
-
-bool operator!=( const Coord2D& c1, const Coord2D& c2 ) {
-    return c1.row() != c2.row() || c1.col() != c2.col();
-}
-
-bool operator<=( const Coord2D& c1, const Coord2D& c2 ) {
-    return c1.position() <= c2.position();
-}
-
-bool operator<( const Coord2D& c1, const Coord2D& c2 ) {
-    return c1.position() < c2.position();
-}
-
-bool operator>=( const Coord2D& c1, const Coord2D& c2 ) {
-    return c1.position() >= c2.position();
-}
+/* class Matrix2D implementation */
 
-bool operator>( const Coord2D& c1, const Coord2D& c2 ) {
-    return c1.position() > c2.position();
+/* Returns the number of bits needed to store @value */
+static int
+elementBitsOf( Matrix2D::ElementT value ) {
+    if( value <= 1 ) return 1;
+    if( value <= UINT8_MAX ) return 8;
+    if( value <= UINT16_MAX ) return 16;
+    return 32;
 }
 
-/* class Matrix2D implementation */
-
 Matrix2D::Matrix2D( unsigned int width, unsigned int height, unsigned int base ) :
     m_width( width ),
     m_height( height ),
     m_base( base ),
+    m_flags( ((std::size_t)width*height + 63) / 64, 0 ),
     m_massfunc( NULL ) {
-    m_buffer = new ElementT[width*height];
+    allocate( elementBitsOf( base ? base-1 : 0 ) );
 }
 
 Matrix2D::Matrix2D( const Matrix2D& mat ) : 
     m_width( mat.width() ),
     m_height( mat.height() ),
     m_base( mat.m_base ), 
-    m_massfunc( NULL ) {
-    m_buffer = new ElementT[width()*height()];
-    std::copy( mat.data(), mat.data() + mat.count(), data()); 
-}
+    m_elementBits( mat.m_elementBits ),
+    m_rowWords( mat.m_rowWords ),
+    m_buffer( mat.m_buffer ),
+    m_flags( mat.m_flags ),
+    m_massfunc( NULL ) {}
 
-Matrix2D::~Matrix2D() {
-    delete data();
-}
+Matrix2D::~Matrix2D() {}
 
 Coord2D 
 Matrix2D::makeCoord( int row, int col ) {
-    return Coord2D( row, col, width() );
+    return Coord2D( row, col );
 }
 
 void 
 Matrix2D::clear() {
-    std::fill( data(), data() + count(), 0 );
+    std::fill( m_buffer.begin(), m_buffer.end(), 0 );
+    unflagAll();
 }
 
-Matrix2D::ElementT* 
-Matrix2D::data() {
-    return m_buffer;
-}
-
-const Matrix2D::ElementT* 
-Matrix2D::data() const {
-    return m_buffer;
-}
-
-Matrix2D::ElementT* 
-Matrix2D::rowPtr( unsigned int row ) {
-    return data() + row*width();
-}
-
-const Matrix2D::ElementT* 
-Matrix2D::rowPtr( unsigned int row ) const {
-    return data() + row*width();
+void
+Matrix2D::readRow( unsigned int row, ElementT* dst ) const {
+    const std::size_t first =(std::size_t)row * width();
+    switch( m_elementBits ) {
+        case 1: {
+            const uint64_t* bits =rowBits( row );
+            for( unsigned int j =0; j < width(); j++ )
+                dst[j] =(bits[j >> 6] >> (j & 63)) & 1;
+            break;
+        }
+        case 8: std::copy( buffer<uint8_t>() + first, buffer<uint8_t>() + first + width(), dst ); break;
+        case 16: std::copy( buffer<uint16_t>() + first, buffer<uint16_t>() + first + width(), dst ); break;
+        default: std::copy( buffer<uint32_t>() + first, buffer<uint32_t>() + first + width(), dst ); break;
+    }
 }
 
-/*Matrix2D::ElementT& Matrix2D::value( Coord2D c ) {
-    return data()[c.col() + c.row() * c.rowLength()] & ~VOUW_UNODE32_FLAGGED;
-}*/
-
-Matrix2D::ElementT 
-Matrix2D::value( Coord2D c ) const {
-    return data()[c.col() + c.row() * width()] & ~VOUW_UNODE32_FLAGGED;
+void
+Matrix2D::writeRow( unsigned int row, const ElementT* src ) {
+    if( !width() ) return;
+    widen( *std::max_element( src, src + width() ) );
+    const std::size_t first =(std::size_t)row * width();
+    switch( m_elementBits ) {
+        case 1: {
+            uint64_t* bits =reinterpret_cast<uint64_t*>( m_buffer.data() ) + (std::size_t)row * m_rowWords;
+            std::fill( bits, bits + m_rowWords, 0 );
+            for( unsigned int j =0; j < width(); j++ )
+                bits[j >> 6] |= (uint64_t)src[j] << (j & 63);
+            break;
+        }
+        case 8: std::copy( src, src + width(), m_buffer.data() + first ); break;
+        case 16: std::copy( src, src + width(), reinterpret_cast<uint16_t*>( m_buffer.data() ) + first ); break;
+        default: std::copy( src, src + width(), reinterpret_cast<uint32_t*>( m_buffer.data() ) + first ); break;
+    }
 }
 
 void 
 Matrix2D::setValue( Coord2D c, const ElementT& e ) {
-    bool flag =isFlagged( c );
-    data()[c.col() + c.row() * width()] = (e & ~VOUW_UNODE32_FLAGGED) | (flag ? VOUW_UNODE32_FLAGGED : 0);
+    widen( e );
+    const std::size_t i =c.col() + c.row() * width();
+    switch( m_elementBits ) {
+        case 1: {
+            uint64_t& word =reinterpret_cast<uint64_t*>( m_buffer.data() )[(std::size_t)c.row() * m_rowWords + (c.col() >> 6)];
+            const uint64_t bit =1ULL << (c.col() & 63);
+            word =e ? word | bit : word & ~bit;
+            break;
+        }
+        case 8: m_buffer[i] =e; break;
+        case 16: reinterpret_cast<uint16_t*>( m_buffer.data() )[i] =e; break;
+        default: reinterpret_cast<uint32_t*>( m_buffer.data() )[i] =e; break;
+    }
 }
 
 void 
 Matrix2D::setFlagged( const Coord2D& c, bool flag ) {
+    const std::size_t i =c.col() + c.row() * width();
     if( flag )
-        data()[c.col() + c.row() * width()] |= VOUW_UNODE32_FLAGGED;
+        m_flags[i >> 6] |= 1ULL << (i & 63);
     else
-        data()[c.col() + c.row() * width()] &= ~VOUW_UNODE32_FLAGGED;
-}
-
-bool
-Matrix2D::isFlagged( const Coord2D& c ) const {
-    return data()[c.col() + c.row() * width()] & VOUW_UNODE32_FLAGGED;
+        m_flags[i >> 6] &= ~(1ULL << (i & 63));
 }
 
 void
 Matrix2D::unflagAll() {
-    unsigned int i =0;
-    while( i < count() ) {
-        data()[i++] &= ~VOUW_UNODE32_FLAGGED;
-    }
+    std::fill( m_flags.begin(), m_flags.end(), 0 );
 }
 
 bool
@@ -139,9 +130,24 @@ Matrix2D::checkBounds( const Coord2D& c ) const {
 
 bool 
 Matrix2D::operator==( const Matrix2D& mat ) {
-    if( !(mat.width() == width() && mat.height() == height() && mat.base() == base() ) )
+    if( mat.base() != base() || m_flags != mat.m_flags ) 
+        return false;
+    return hasSameValues( mat );
+}
+
+bool
+Matrix2D::hasSameValues( const Matrix2D& mat ) const {
+    if( !(mat.width() == width() && mat.height() == height()) )
         return false;
-    return std::equal( data(), data() + count(), mat.data() );
+    if( m_elementBits == mat.m_elementBits ) return m_buffer == mat.m_buffer;
+    // A wider matrix may still hold only narrow values
+    std::vector<ElementT> row1( width() ), row2( width() );
+    for( unsigned int i =0; i < height(); i++ ) {
+        readRow( i, row1.data() );
+        mat.readRow( i, row2.data() );
+        if( row1 != row2 ) return false;
+    }
+    return true;
 }
 
 const MassFunction&
@@ -149,14 +155,55 @@ Matrix2D::distribution( bool force_regenerate ) {
     // (re-)generate the distribution
     if( !m_massfunc || force_regenerate ) {
         if( m_massfunc ) m_massfunc->clear();
-        else m_massfunc = new MassFunction();
-        unsigned int i =0;
-        while( i < count() ) {
-            m_massfunc->increment( data()[i++] & ~VOUW_UNODE32_FLAGGED );
+        else m_massfunc = new MassFunction( base() );
+        switch( m_elementBits ) {
+            case 1: {
+                // The padding of the rows is zero
+                std::size_t ones =0;
+                const uint64_t* bits =reinterpret_cast<const uint64_t*>( m_buffer.data() );
+                for( std::size_t w =0; w < (std::size_t)height() * m_rowWords; w++ )
+                    ones += std::bitset<64>( bits[w] ).count();
+                m_massfunc->setCount( 0, count() - ones );
+                m_massfunc->setCount( 1, ones );
+                break;
+            }
+            case 8: m_massfunc->increment( buffer<uint8_t>(), count() ); break;
+            case 16: m_massfunc->increment( buffer<uint16_t>(), count() ); break;
+            default: m_massfunc->increment( buffer<uint32_t>(), count() ); break;
         }
     }
     return *m_massfunc;
 }
 
+/* Private functions */
+
+/** Sets the element width to @bits and allocates zeroed storage */
+void
+Matrix2D::allocate( int bits ) {
+    m_elementBits =bits;
+    if( bits == 1 ) {
+        m_rowWords =(width() + 63) / 64;
+        m_buffer.assign( (std::size_t)height() * m_rowWords * sizeof( uint64_t ), 0 );
+    } else {
+        m_rowWords =0;
+        m_buffer.assign( (std::size_t)count() * bits / 8, 0 );
+    }
+}
+
+/** Makes sure @value can be stored, converting the storage to a wider type if needed */
+void
+Matrix2D::widen( ElementT value ) {
+    const int bits =elementBitsOf( value );
+    if( bits <= m_elementBits ) return;
+
+    std::vector<ElementT> values( count() );
+    for( unsigned int i =0; i < height(); i++ )
+        readRow( i, values.data() + (std::size_t)i * width() );
+
+    allocate( bits );
+    for( unsigned int i =0; i < height(); i++ )
+        writeRow( i, values.data() + (std::size_t)i * width() );
+}
+
 VOUW_NAMESPACE_END
 
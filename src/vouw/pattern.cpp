@@ -8,6 +8,8 @@
 #include <vouw/pattern.h>
 #include <vouw/equivalence.h>
 #include <vouw/massfunction.h>
+#include <vouw/instance_matrix.h>
+#include <vouw/codelength.h>
 #include <cmath>
 #include <cassert>
 #include <cstdio>
@@ -19,25 +21,25 @@ VOUW_NAMESPACE_BEGIN
 
 /* class Pattern::OffsetT implementation */
 
-Pattern::OffsetT::OffsetT( int row, int col, int rowLength ) 
-    : Coord2D( row, col, rowLength ) {}
+Pattern::OffsetT::OffsetT( int row, int col ) 
+    : Coord2D( row, col ) {}
 
 Pattern::OffsetT::OffsetT( const Coord2D& pivot1, const Coord2D& pivot2 ) 
-    : Coord2D( pivot2.row() - pivot1.row(), pivot2.col() - pivot1.col(), pivot1.rowLength() ) {}
+    : Coord2D( pivot2.row() - pivot1.row(), pivot2.col() - pivot1.col() ) {}
 
 Coord2D 
 Pattern::OffsetT::abs( const Coord2D& c ) const {
-    return Coord2D( c.row() + row(), c.col() + col(), c.rowLength() );
+    return Coord2D( c.row() + row(), c.col() + col() );
 }
 
 Pattern::OffsetT 
 Pattern::OffsetT::translate( const OffsetT& o ) const {
-    return OffsetT( o.row() + row(), o.col() + col(), rowLength() );
+    return OffsetT( o.row() + row(), o.col() + col() );
 }
 
 Pattern::OffsetT 
 Pattern::OffsetT::negate() const {
-    return OffsetT( -row(), -col(), rowLength() );
+    return OffsetT( -row(), -col() );
 }
 
 DirT
@@ -50,11 +52,6 @@ Pattern::OffsetT::direction() const {
         //return (DirT)(2 << ((!!col()) << (col()<0)));
 }
 
-int
-Pattern::OffsetT::position() const {
-    return 2*(rowLength()-1)*row() + (rowLength()-1)+col();
-}
-
 /* class Pattern implementation */
 
 Pattern::Pattern()
@@ -78,8 +75,10 @@ Pattern::Pattern( const Pattern& p ) {
     m_active = p.m_active;
     m_tabu = p.m_tabu;
     m_composition = p.m_composition;
-    for( int i =0; i < 2; i++ )
+    for( int i =0; i < 2; i++ ) {
         m_periphery[i] = p.m_periphery[i];
+        m_peripheryDelta[i] = p.m_peripheryDelta[i];
+    }
 }
 
 Pattern::Pattern( const Matrix2D::ElementT& value, int rowLength ) 
@@ -90,7 +89,7 @@ Pattern::Pattern( const Matrix2D::ElementT& value, int rowLength )
     m_active( true ), m_tabu( false ) {
     m_bounds ={ 0,0,0,0,1,1 };
     m_composition = { 0, 0, 0, 0, OffsetT() };
-    m_elements.push_back( { OffsetT(0,0,rowLength), value } );
+    m_elements.push_back( { OffsetT(0,0), value } );
     recomputePeriphery();
 }
 
@@ -129,8 +128,8 @@ Pattern::codeLength( int usage, int totalInstances, int modelSize ) {
     if( !usage )
         return 0.0;
     //return -log2( ((double)usage) / ((double)totalInstances) );
-    return  - lgamma( (double)usage + pseudoCount ) / log(2)
-            + lgamma( pseudoCount ) / log(2);
+    return  - log2Gamma( usage, 1 )
+            + log2Gamma( 0, 1 );
 
     //fprintf( stderr, "codeLength %d,%d,%d = %f\n", usage, totalInstances, modelSize, l );
 }
@@ -192,9 +191,7 @@ Pattern::updateEntryLength( const MassFunction& dist, int matrixWidth, int matri
 void 
 Pattern::setRowLength( int l ) {
     m_rowLength =l;
-    for( auto&& elem : m_elements ) {
-        elem.offset.setRowLength( l );
-    }
+    recomputePeripheryDelta();
 }
 
 void 
@@ -249,31 +246,70 @@ bool
 Pattern::isCanonical() const {
     ElementT elem0 =*elements().begin();
     if( !elem0.offset.isZero() ) return false;
-    int position = elem0.offset.position();
+    OffsetT prev = elem0.offset;
 
     for( auto&& elem : elements() ) {
-        if( elem.offset.position() < position ) return false;
-        position = elem.offset.position();
+        if( elem.offset < prev ) return false;
+        prev = elem.offset;
     }
     return true;
 }
 
-bool 
-Pattern::test( Matrix2D* mat, const Coord2D& pivot, bool isEqual, bool isFlagged, bool isUnflagged ) {
-
+uint64_t
+Pattern::contentHash() const {
+    // FNV-1a over the values and the offsets relative to the first element, 
+    // such that the hash does not depend on the position of the pivot
+    const OffsetT& first =m_elements.front().offset;
+    uint64_t h =0xcbf29ce484222325ULL;
     for( auto&& elem : elements() ) {
-        Coord2D c =elem.offset.abs( pivot );
-
-        if( isUnflagged && mat->isFlagged( c ) ) return false;
-        if( isFlagged && !mat->isFlagged( c ) ) return false;
+        const int row =elem.offset.row() - first.row(), col =elem.offset.col() - first.col();
+        uint64_t v =((uint64_t)(uint32_t)row << 32) | (uint32_t)col;
+        h =(h ^ v) * 0x100000001b3ULL;
+        h =(h ^ elem.value) * 0x100000001b3ULL;
+    }
+    return h;
+}
 
-        if( isEqual && mat->value( c ) != elem.value )
+bool
+Pattern::hasSameElements( const Pattern& p ) const {
+    if( size() != p.size() ) return false;
+    const OffsetT shift( m_elements.front().offset, p.m_elements.front().offset );
+    for( int i =0; i < size(); i++ )
+        if( m_elements[i].offset.translate( shift ) != p.m_elements[i].offset || m_elements[i].value != p.m_elements[i].value )
             return false;
+    return true;
+}
+
+bool 
+Pattern::test( Matrix2D* mat, const Coord2D& pivot, bool isEqual, bool isFlagged, bool isUnflagged ) {
+    const bool needsMask =isFlagged || isUnflagged || (isEqual && mat->isBitPacked());
+    if( needsMask && m_mask.empty() ) m_mask =MaskT( *this );
+
+    if( isUnflagged && !m_mask.isClear( mat->flags(), mat->width(), origin( pivot ) ) ) return false;
+    if( isFlagged && !m_mask.isSet( mat->flags(), mat->width(), origin( pivot ) ) ) return false;
+
+    if( isEqual ) {
+        switch( mat->elementBits() ) {
+            case 1: return m_mask.matches( mat, origin( pivot ) );
+            case 8: return testValues( mat->buffer<uint8_t>(), mat->width(), pivot );
+            case 16: return testValues( mat->buffer<uint16_t>(), mat->width(), pivot );
+            default: return testValues( mat->buffer<uint32_t>(), mat->width(), pivot );
+        }
     }
 
     return true;
 }
 
+/** Compares the values of the elements to the storage of a matrix with rows of @rowLength elements */
+template<typename T> bool
+Pattern::testValues( const T* buffer, int rowLength, const Coord2D& pivot ) const {
+    const std::ptrdiff_t origin =(std::ptrdiff_t)pivot.row() * rowLength + pivot.col();
+    for( auto&& elem : elements() )
+        if( buffer[origin + elem.offset.row() * rowLength + elem.offset.col()] != elem.value )
+            return false;
+    return true;
+}
+
 void 
 Pattern::apply( Matrix2D* mat, const Coord2D& pivot, bool setValue, bool flag, bool unflag ) {
 
@@ -380,7 +416,7 @@ Pattern::recomputePeriphery() {
             // If these elements are not adjacent, we need to fill the 'gaps'
             if( of.col() != curCol + 1 ) {
                 for( int j =curCol+1; j < of.col(); j++ )
-                    m_periphery[PosteriorPeriphery].push_back( OffsetT( curRow + m_bounds.rowMin, j, m_rowLength ) );
+                    m_periphery[PosteriorPeriphery].push_back( OffsetT( curRow + m_bounds.rowMin, j ) );
             }
             curCol =of.col();
         } else {
@@ -401,24 +437,26 @@ Pattern::recomputePeriphery() {
 
         // Anterior
         for( int j =std::min( minCol, firstCol ); j <= firstCol; j++ )
-            m_periphery[AnteriorPeriphery].push_back( OffsetT( row, j-1, m_rowLength ) );
+            m_periphery[AnteriorPeriphery].push_back( OffsetT( row, j-1 ) );
         
         // Posterior
         for( int j =lastCol; j <= std::max( maxCol, lastCol ); j++ )
-            m_periphery[PosteriorPeriphery].push_back( OffsetT( row, j+1, m_rowLength ) );
+            m_periphery[PosteriorPeriphery].push_back( OffsetT( row, j+1 ) );
     }
     // Fill the first-1 and last+1 rows
     { // Anterior
         int firstCol = columns[0][FirstCol] -1, lastCol = columns[0][LastCol]+1;
         for( int j =firstCol; j <= lastCol ; j++ )
-            m_periphery[AnteriorPeriphery].push_back( OffsetT( m_bounds.rowMin-1, j, m_rowLength ) );
+            m_periphery[AnteriorPeriphery].push_back( OffsetT( m_bounds.rowMin-1, j ) );
     }
     { // Posterior
         int firstCol = columns[rows-1][FirstCol] -1, lastCol = columns[rows-1][LastCol]+1;
         for( int j =firstCol; j <= lastCol ; j++ )
-            m_periphery[PosteriorPeriphery].push_back( OffsetT( m_bounds.rowMax+1, j, m_rowLength ) );
+            m_periphery[PosteriorPeriphery].push_back( OffsetT( m_bounds.rowMax+1, j ) );
     }
 
+    recomputePeripheryDelta();
+
     for( auto offset : m_periphery[AnteriorPeriphery] )
         if( std::find( m_periphery[PosteriorPeriphery].begin(),m_periphery[PosteriorPeriphery].end(), offset ) != m_periphery[PosteriorPeriphery].end() ) {
             fprintf( stderr, "\n*******\nPeripheries overlap oh noes\n********\n\n" );
@@ -428,5 +466,101 @@ Pattern::recomputePeriphery() {
 
 }
 
-VOUW_NAMESPACE_END
+void
+Pattern::moveToArena( Arena* arena ) {
+    ListT elements( m_elements.begin(), m_elements.end(), ListT::allocator_type( arena ) );
+    m_elements.swap( elements );
+    for( int i =0; i < 2; i++ ) {
+        PeripheryT periphery( m_periphery[i].begin(), m_periphery[i].end(), PeripheryT::allocator_type( arena ) );
+        m_periphery[i].swap( periphery );
+        PeripheryDeltaT delta( m_peripheryDelta[i].begin(), m_peripheryDelta[i].end(), PeripheryDeltaT::allocator_type( arena ) );
+        m_peripheryDelta[i].swap( delta );
+    }
+}
+
+void
+Pattern::release() {
+    ListT().swap( m_elements );
+    m_mask =MaskT();
+    for( int i =0; i < 2; i++ ) {
+        PeripheryT().swap( m_periphery[i] );
+        PeripheryDeltaT().swap( m_peripheryDelta[i] );
+    }
+}
 
+std::size_t
+Pattern::storageSize() const {
+    std::size_t bytes =m_elements.capacity() * sizeof( ElementT );
+    for( int i =0; i < 2; i++ )
+        bytes += m_periphery[i].capacity() * sizeof( OffsetT ) + m_peripheryDelta[i].capacity() * sizeof( int );
+    return bytes;
+}
+
+/** Translates the periphery to distances between keys in an InstanceMatrix of the same row length */
+void
+Pattern::recomputePeripheryDelta() {
+    const int stride =InstanceMatrix::stride( m_rowLength );
+    for( int i =0; i < 2; i++ ) {
+        m_peripheryDelta[i].clear();
+        for( auto&& offset : m_periphery[i] )
+            m_peripheryDelta[i].push_back( offset.row() * stride + offset.col() );
+    }
+}
+
+/* class Pattern::MaskT implementation */
+
+Pattern::MaskT::MaskT( const Pattern& p ) : m_isBinary( true ) {
+    const BoundsT b =p.bounds();
+    m_words =(b.width + 63) / 64;
+    m_care.assign( b.height * m_words, 0 );
+    m_values.assign( b.height * m_words, 0 );
+    for( auto&& elem : p.elements() ) {
+        const int col =elem.offset.col() - b.colMin;
+        const std::size_t k =(elem.offset.row() - b.rowMin) * m_words + col / 64;
+        m_care[k] |= 1ULL << (col % 64);
+        m_values[k] |= (uint64_t)(elem.value & 1) << (col % 64);
+        if( elem.value > 1 ) m_isBinary =false;
+    }
+}
+
+/** Compares 64 columns of a row at a time with one XOR and one AND */
+bool
+Pattern::MaskT::matches( const Matrix2D* mat, const Coord2D& origin ) const {
+    if( !m_isBinary ) return false;
+    for( std::size_t k =0; k < m_care.size(); k++ ) {
+        const int row =origin.row() + k / m_words, col =origin.col() + 64 * (k % m_words);
+        if( (mat->bitWindow( row, col ) ^ m_values[k]) & m_care[k] )
+            return false;
+    }
+    return true;
+}
+
+bool
+Pattern::MaskT::isClear( const std::vector<uint64_t>& plane, int rowLength, const Coord2D& origin ) const {
+    for( std::size_t k =0; k < m_care.size(); k++ ) {
+        const Coord2D c( origin.row() + k / m_words, origin.col() + 64 * (k % m_words) );
+        if( bitPlaneWindow( plane, c.position( rowLength ) ) & m_care[k] )
+            return false;
+    }
+    return true;
+}
+
+bool
+Pattern::MaskT::isSet( const std::vector<uint64_t>& plane, int rowLength, const Coord2D& origin ) const {
+    for( std::size_t k =0; k < m_care.size(); k++ ) {
+        const Coord2D c( origin.row() + k / m_words, origin.col() + 64 * (k % m_words) );
+        if( ~bitPlaneWindow( plane, c.position( rowLength ) ) & m_care[k] )
+            return false;
+    }
+    return true;
+}
+
+void
+Pattern::MaskT::set( std::vector<uint64_t>& plane, int rowLength, const Coord2D& origin ) const {
+    for( std::size_t k =0; k < m_care.size(); k++ ) {
+        const Coord2D c( origin.row() + k / m_words, origin.col() + 64 * (k % m_words) );
+        bitPlaneSet( plane, c.position( rowLength ), m_care[k] );
+    }
+}
+
+VOUW_NAMESPACE_END
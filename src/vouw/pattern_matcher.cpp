@@ -0,0 +1,185 @@
+/*
+ * VOUW - Spatial, compression-based pattern mining on matrices
+ *
+ * Micky Faas <micky@edukitty.org>
+ * (C) 2017, 2018, 2019, Leiden Institute for Advanced Computer Science
+ */
+
+#include <vouw/pattern_matcher.h>
+#include <vouw/pattern.h>
+#include <algorithm>
+#include <thread>
+
+VOUW_NAMESPACE_BEGIN
+
+/* Both bases are odd, such that their powers are invertible modulo 2^64 */
+#define PATTERNMATCHER_COL_BASE 0x9e3779b97f4a7c15ULL
+#define PATTERNMATCHER_ROW_BASE 0xc2b2ae3d27d4eb4fULL
+
+/** Scrambles a value before it enters the polynomial, such that small values do not cancel out */
+static inline uint64_t
+valueHash( Matrix2D::ElementT v ) {
+    uint64_t h =(uint64_t)v + 0x9e3779b97f4a7c15ULL;
+    h =(h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h =(h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+/** Inverse of the odd number @a modulo 2^64 by Newton's iteration */
+static uint64_t
+inverse( uint64_t a ) {
+    uint64_t x =a;
+    for( int i =0; i < 5; i++ ) x *= 2 - a * x;
+    return x;
+}
+
+PatternMatcher::PatternMatcher( const Matrix2D* mat, int threadCount ) :
+    m_mat( mat ),
+    m_threadCount( std::max( 1, threadCount ) ),
+    m_colPow( mat->width() + 1 ),
+    m_colPowInv( mat->width() + 1 ),
+    m_rowPow( mat->height() + 1 ),
+    m_collisions( 0 ) {
+
+    const uint64_t inv =inverse( PATTERNMATCHER_COL_BASE );
+    m_colPow[0] =m_colPowInv[0] =m_rowPow[0] =1;
+    for( unsigned int j =1; j < m_colPow.size(); j++ ) {
+        m_colPow[j] =m_colPow[j-1] * PATTERNMATCHER_COL_BASE;
+        m_colPowInv[j] =m_colPowInv[j-1] * inv;
+    }
+    for( unsigned int i =1; i < m_rowPow.size(); i++ )
+        m_rowPow[i] =m_rowPow[i-1] * PATTERNMATCHER_ROW_BASE;
+}
+
+int
+PatternMatcher::add( const Pattern* p ) {
+    const int idx =m_patterns.size();
+    m_patterns.push_back( p );
+    m_masks.emplace_back( *p );
+    m_matches.emplace_back();
+
+    // A pattern that is larger than the matrix cannot match anywhere
+    const Pattern::BoundsT b =p->bounds();
+    if( b.width > (int)m_mat->width() || b.height > (int)m_mat->height() )
+        return idx;
+
+    const ConfigIDT id =m_configs.id( Configuration( *p ) );
+    if( id == m_groups.size() ) {
+        std::vector<Coord2D> cells;
+        for( auto&& elem : p->elements() )
+            cells.emplace_back( elem.offset.row() - b.rowMin, elem.offset.col() - b.colMin );
+        std::sort( cells.begin(), cells.end() );
+
+        GroupT g;
+        g.width =b.width;
+        g.height =b.height;
+        for( auto&& c : cells ) {
+            if( !g.runs.empty() && g.runs.back().row == c.row() && g.runs.back().end == c.col() )
+                g.runs.back().end++;
+            else
+                g.runs.push_back( RunT{ c.row(), c.col(), c.col() + 1 } );
+        }
+        m_groups.push_back( std::move( g ) );
+    }
+
+    // The same polynomial as the windows, with the top-left of the bounds at the origin
+    uint64_t h =0;
+    for( auto&& elem : p->elements() )
+        h += valueHash( elem.value ) * m_rowPow[elem.offset.row() - b.rowMin] * m_colPow[elem.offset.col() - b.colMin];
+    m_groups[id].index.insert( std::make_pair( h, idx ) );
+
+    return idx;
+}
+
+void
+PatternMatcher::run() {
+    const int height =m_mat->height();
+    const int bands =std::max( 1, std::min( m_threadCount, height / 16 ) );
+    std::vector<std::thread> threads;
+
+    m_prefix.resize( (std::size_t)height * (m_mat->width() + 1) );
+    for( int b =0; b < bands; b++ )
+        threads.emplace_back( &PatternMatcher::computePrefixRows, this, height * b / bands, height * (b+1) / bands );
+    for( auto&& t : threads ) t.join();
+    threads.clear();
+
+    std::vector<BandT> results( bands );
+    for( int b =0; b < bands; b++ )
+        threads.emplace_back( &PatternMatcher::searchBand, this, height * b / bands, height * (b+1) / bands, &results[b] );
+    for( auto&& t : threads ) t.join();
+
+    // The bands are consecutive, concatenating them keeps the pivots in row-major order
+    for( int i =0; i < size(); i++ ) {
+        std::size_t n =0;
+        for( auto&& band : results ) n += band.matches[i].size();
+        m_matches[i].clear();
+        m_matches[i].reserve( n );
+        for( auto&& band : results )
+            m_matches[i].insert( m_matches[i].end(), band.matches[i].begin(), band.matches[i].end() );
+    }
+    m_collisions =0;
+    for( auto&& band : results ) m_collisions += band.collisions;
+
+    std::vector<uint64_t>().swap( m_prefix );
+}
+
+/* Private functions */
+
+void
+PatternMatcher::computePrefixRows( int rowBegin, int rowEnd ) {
+    const int width =m_mat->width();
+    std::vector<Matrix2D::ElementT> row( width );
+    for( int i =rowBegin; i < rowEnd; i++ ) {
+        m_mat->readRow( i, row.data() );
+        uint64_t* prefix =&m_prefix[(std::size_t)i * (width + 1)];
+        prefix[0] =0;
+        for( int j =0; j < width; j++ )
+            prefix[j+1] =prefix[j] + valueHash( row[j] ) * m_colPow[j];
+    }
+}
+
+/** Searches all windows with their top row in [@rowBegin,@rowEnd). Only reads the matrix and the prefix sums */
+void
+PatternMatcher::searchBand( int rowBegin, int rowEnd, BandT* band ) const {
+    const int width =m_mat->width(), height =m_mat->height();
+    const std::size_t stride =width + 1;
+    band->matches.resize( size() );
+    band->collisions =0;
+
+    for( auto&& g : m_groups ) {
+        const int lastRow =std::min( rowEnd, height - g.height + 1 );
+        for( int i =rowBegin; i < lastRow; i++ ) {
+            for( int j =0; j + g.width <= width; j++ ) {
+                uint64_t h =0;
+                for( auto&& run : g.runs ) {
+                    const uint64_t* prefix =&m_prefix[(i + run.row) * stride + j];
+                    h += (prefix[run.end] - prefix[run.begin]) * m_rowPow[run.row];
+                }
+                // Move the window back to the first column
+                h *= m_colPowInv[j];
+
+                auto range =g.index.equal_range( h );
+                for( auto it =range.first; it != range.second; it++ ) {
+                    const Pattern* p =m_patterns[it->second];
+                    const Coord2D pivot( i - p->bounds().rowMin, j - p->bounds().colMin );
+                    if( verify( it->second, pivot ) )
+                        band->matches[it->second].push_back( pivot );
+                    else
+                        band->collisions++;
+                }
+            }
+        }
+    }
+}
+
+bool
+PatternMatcher::verify( int idx, const Coord2D& pivot ) const {
+    const Pattern* p =m_patterns[idx];
+    if( m_mat->isBitPacked() )
+        return m_masks[idx].matches( m_mat, p->origin( pivot ) );
+    for( auto&& elem : p->elements() )
+        if( m_mat->value( elem.offset.abs( pivot ) ) != elem.value ) return false;
+    return true;
+}
+
+VOUW_NAMESPACE_END
@@ -0,0 +1,129 @@
+/*
+ * VOUW - Spatial, compression-based pattern mining on matrices
+ *
+ * Micky Faas <micky@edukitty.org>
+ * (C) 2017, 2018, 2019, Leiden Institute for Advanced Computer Science
+ */
+
+#include <vouw/rans.h>
+#include <algorithm>
+#include <cmath>
+#include <cassert>
+
+VOUW_NAMESPACE_BEGIN
+
+/* The state is kept in [RANS_LOWER,RANS_LOWER << 32) */
+#define RANS_LOWER (1ULL << 31)
+
+/* Size of the blocks in which the decoder reads its input */
+#define RANS_BLOCK_SIZE (1 << 16)
+
+static void
+writeWord( std::ostream& os, uint32_t w ) {
+    const char bytes[4] = { (char)(w & 0xff), (char)((w >> 8) & 0xff), (char)((w >> 16) & 0xff), (char)(w >> 24) };
+    os.write( bytes, 4 );
+}
+
+/* class RansEncoder implementation */
+
+void
+RansEncoder::put( uint32_t start, uint32_t freq ) {
+    assert( freq > 0 && start + (uint64_t)freq <= RANS_SCALE );
+    m_symbols.push_back( (uint64_t)start << 32 | freq );
+    m_bits += RANS_SCALE_BITS - log2( freq );
+}
+
+void
+RansEncoder::putUniform( uint32_t v, uint32_t n ) {
+    const uint32_t start =ransScale( v, n );
+    put( start, ransScale( v + 1, n ) - start );
+}
+
+void
+RansEncoder::putUInt( uint32_t v ) {
+    // The number of bits followed by all but the leading one
+    int nbits =0;
+    while( nbits < 32 && (v >> nbits) ) nbits++;
+    putUniform( nbits, 33 );
+    if( nbits > 1 )
+        putUniform( v & ((1U << (nbits-1)) - 1), 1U << (nbits-1) );
+}
+
+std::size_t
+RansEncoder::flush( std::ostream& os ) {
+    // The words come out in reverse, the decoder reads the final state first
+    std::vector<uint32_t> words;
+    uint64_t x =RANS_LOWER;
+    for( auto it =m_symbols.rbegin(); it != m_symbols.rend(); it++ ) {
+        const uint32_t start =*it >> 32, freq =(uint32_t)*it;
+        const uint64_t max =((RANS_LOWER >> RANS_SCALE_BITS) << 32) * freq;
+        if( x >= max ) {
+            words.push_back( (uint32_t)x );
+            x >>= 32;
+        }
+        x =((x / freq) << RANS_SCALE_BITS) + (x % freq) + start;
+    }
+    writeWord( os, (uint32_t)x );
+    writeWord( os, (uint32_t)(x >> 32) );
+    for( auto it =words.rbegin(); it != words.rend(); it++ )
+        writeWord( os, *it );
+    m_symbols.clear();
+    return 4 * (words.size() + 2);
+}
+
+/* class RansDecoder implementation */
+
+RansDecoder::RansDecoder( std::istream& is, uint64_t length ) :
+    m_is( is ), m_remaining( length ), m_state( 0 ),
+    m_buffer( RANS_BLOCK_SIZE ), m_pos( 0 ), m_end( 0 ), m_valid( true ) {
+    m_state =readWord();
+    m_state |= (uint64_t)readWord() << 32;
+}
+
+void
+RansDecoder::advance( uint32_t start, uint32_t freq ) {
+    m_state =freq * (m_state >> RANS_SCALE_BITS) + (m_state & (RANS_SCALE - 1)) - start;
+    if( m_state < RANS_LOWER )
+        m_state =(m_state << 32) | readWord();
+}
+
+uint32_t
+RansDecoder::getUniform( uint32_t n ) {
+    if( n == 0 ) {
+        m_valid =false;
+        return 0;
+    }
+    const uint32_t v =(uint32_t)ransUnscale( peek(), n );
+    const uint32_t start =ransScale( v, n );
+    advance( start, ransScale( v + 1, n ) - start );
+    return v;
+}
+
+uint32_t
+RansDecoder::getUInt() {
+    const int nbits =getUniform( 33 );
+    if( nbits <= 1 ) return nbits;
+    return (1U << (nbits-1)) | getUniform( 1U << (nbits-1) );
+}
+
+uint32_t
+RansDecoder::readWord() {
+    uint32_t w =0;
+    for( int i =0; i < 4; i++ ) {
+        if( m_pos == m_end ) {
+            const std::size_t n =(std::size_t)std::min<uint64_t>( m_remaining, m_buffer.size() );
+            m_is.read( m_buffer.data(), n );
+            m_end =m_is.gcount();
+            m_remaining -= m_end;
+            m_pos =0;
+            if( m_end == 0 ) {
+                m_valid =false;
+                return 0;
+            }
+        }
+        w |= (uint32_t)(uint8_t)m_buffer[m_pos++] << (8*i);
+    }
+    return w;
+}
+
+VOUW_NAMESPACE_END